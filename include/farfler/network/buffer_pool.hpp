@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace farfler::network {
+
+// Reusable byte buffers in power-of-two size classes. A buffer goes back on
+// its class's free list when the last handle to it is dropped, so once the
+// pool has warmed up the send and receive paths stop touching the heap.
+// Requests larger than the biggest class are served straight from the heap.
+class BufferPool : public std::enable_shared_from_this<BufferPool> {
+ private:
+  struct Block;
+
+ public:
+  static constexpr std::size_t kMinBlockSize = 256;
+  static constexpr std::size_t kMaxBlockSize = 4 * 1024 * 1024;
+  static constexpr std::size_t kMaxFreeBytesPerClass = 4 * 1024 * 1024;
+
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes_outstanding;
+  };
+
+  // A reference-counted handle to a pooled buffer. Copies share the buffer.
+  class Buffer {
+   public:
+    Buffer();
+    Buffer(const Buffer& other);
+    Buffer(Buffer&& other) noexcept;
+    Buffer& operator=(Buffer other) noexcept;
+    ~Buffer();
+
+    std::vector<char>& operator*() const;
+    std::vector<char>* operator->() const;
+    explicit operator bool() const;
+
+   private:
+    friend class BufferPool;
+    explicit Buffer(Block* block);
+
+    Block* block_;
+  };
+
+  // Returns a buffer holding exactly size bytes, with room to grow up to its
+  // size class without reallocating.
+  Buffer Acquire(std::size_t size);
+  Stats GetStats() const;
+
+  ~BufferPool();
+
+ private:
+  static constexpr std::size_t kClassCount = 15;
+  static constexpr std::size_t kUnpooled = kClassCount;
+
+  struct Block {
+    std::vector<char> bytes;
+    std::atomic<uint32_t> references;
+    std::shared_ptr<BufferPool> pool;
+    std::size_t size_class;
+    Block* next;
+  };
+
+  static std::size_t SizeClass(std::size_t size);
+  static void Unreference(Block* block);
+  void Release(Block* block);
+
+  std::array<Block*, kClassCount> free_blocks_{};
+  std::array<std::size_t, kClassCount> free_counts_{};
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+  std::atomic<uint64_t> bytes_outstanding_{0};
+  std::mutex mutex_;
+};
+
+}  // namespace farfler::network
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <farfler/network/buffer_pool.hpp>
+#include <farfler/network/handler_memory.hpp>
+#include <farfler/network/stream.hpp>
+#include <farfler/network/topic_options.hpp>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace farfler::network {
+
+// An encoded, length-prefixed TCP frame in a pooled buffer. Frames are not
+// modified once built and are shared by every peer they are sent to, so a
+// publication is encoded once no matter how many connections it fans out to.
+using Frame = BufferPool::Buffer;
+
+// A TCP connection to one peer. Outbound frames are queued in order within
+// their priority lane and written with at most one write outstanding;
+// whatever has queued up while a write was in flight is coalesced into a
+// single gather write, higher lanes first. Frames larger than kFragmentSize
+// go out as fragments, one lane's chunks interleaved with the other lanes'
+// frames. Inbound bytes are read into a growable buffer as they arrive and
+// every complete frame in it is handed to the frame handler in place before
+// the next read is issued; fragments are reassembled first. Each connection
+// has its own strand, so different peers are served in parallel when the
+// io_context runs on several threads.
+//
+// Publications count against the connection's queue limits and their topic's
+// limits until they have been written; control frames are never held back.
+// The connection is throttled from the first publication that hits a limit
+// until its queue has drained completely.
+//
+// Batched publications wait for their batch window unless the socket is
+// already busy; runs of them are packed into batch frames when written.
+// Sockets have Nagle's algorithm turned off, so everything else goes out
+// without delay.
+//
+// With heartbeats on, a connection that is not busy writing sends a heartbeat
+// every interval, and one that has heard nothing from its peer for several
+// intervals in a row fails with timed_out, so a half-open connection is not
+// kept around until the kernel gives up on it.
+class Connection : public std::enable_shared_from_this<Connection> {
+ public:
+  using ErrorHandler = std::function<void(std::shared_ptr<Connection>,
+                                          const boost::system::error_code&)>;
+  using FrameHandler =
+      std::function<void(std::shared_ptr<Connection>, ByteReader&)>;
+  using ThrottleHandler =
+      std::function<void(std::shared_ptr<Connection>, bool throttled)>;
+
+  struct QueueStats {
+    std::size_t bytes;
+    std::size_t messages;
+    // Publications that hit a limit, and those of them that were not sent.
+    uint64_t throttled;
+    uint64_t dropped;
+    // Queued publications replaced by a newer one on a conflated topic.
+    uint64_t conflated;
+    // Batch frames written, and the publications packed into them.
+    uint64_t batches;
+    uint64_t batched;
+  };
+
+  static constexpr std::size_t kDefaultMaxWriteSize = 64 * 1024;
+  static constexpr std::size_t kInitialReceiveBufferSize = 64 * 1024;
+  static constexpr std::size_t kDefaultMaxQueuedBytes = 16 * 1024 * 1024;
+  static constexpr std::size_t kDefaultMaxQueuedMessages = 64 * 1024;
+  static constexpr std::size_t kFragmentSize = 16 * 1024;
+  static constexpr std::size_t kDefaultMaxMessageSize = 64 * 1024 * 1024;
+
+  Connection(boost::asio::ip::tcp::socket socket,
+             boost::asio::io_context& io_context,
+             std::shared_ptr<BufferPool> buffer_pool,
+             std::size_t max_write_size = kDefaultMaxWriteSize);
+
+  void Send(Frame frame);
+  PublishStatus SendPublication(uint32_t topic_id, const Frame& announcement,
+                                Frame frame, const TopicOptions& options);
+  void Close();
+  void SetErrorHandler(ErrorHandler handler);
+  void SetFrameHandler(FrameHandler handler);
+  void SetThrottleHandler(ThrottleHandler handler);
+  void SetQueueLimits(const QueueLimits& limits);
+  // Batching for publications on topics that do not override it.
+  void SetBatchOptions(const BatchOptions& options);
+  // Inbound frames, reassembled or not, larger than this close the
+  // connection instead of being buffered.
+  void SetMaxMessageSize(std::size_t size);
+  // A zero interval turns heartbeats off. Takes effect when receiving
+  // starts.
+  void SetHeartbeat(std::chrono::milliseconds interval, unsigned misses);
+  QueueStats GetQueueStats();
+  void StartReceiving();
+
+  boost::asio::ip::tcp::socket& Socket();
+
+  // Topics announced by the peer, indexed by the peer's topic id. Only
+  // touched from the receive path on the connection's strand.
+  void SetRemoteTopic(uint32_t topic_id, const std::string& topic);
+  const std::string* RemoteTopic(uint32_t topic_id) const;
+
+ private:
+  // A view of writing_buffers_ handed to async_write, which would otherwise
+  // copy the whole vector into every write operation.
+  struct WritingBuffers {
+    const boost::asio::const_buffer* begin() const { return buffers->data(); }
+    const boost::asio::const_buffer* end() const {
+      return buffers->data() + buffers->size();
+    }
+
+    const std::vector<boost::asio::const_buffer>* buffers;
+  };
+
+  // Frames that are not publications carry kNoTopic.
+  static constexpr uint32_t kNoTopic = UINT32_MAX;
+  static constexpr std::size_t kNotWaiting = SIZE_MAX;
+  static constexpr std::size_t kLaneCount = 3;
+
+  struct QueuedFrame {
+    Frame frame;
+    uint32_t topic_id;
+    bool batched;
+  };
+
+  // A vector consumed from head and compacted once half of it has been
+  // sent, so it settles at a fixed capacity instead of allocating as it
+  // cycles. The head frame may be partly written as fragments.
+  struct Lane {
+    std::vector<QueuedFrame> frames;
+    std::size_t head = 0;
+    std::size_t fragment_offset = 0;
+  };
+
+  struct TopicQueue {
+    bool announced = false;
+    std::size_t bytes = 0;
+    std::size_t messages = 0;
+    // Where the topic's newest frame waits, if it has not been picked up
+    // for writing yet.
+    std::size_t waiting_lane = 0;
+    std::size_t waiting_index = kNotWaiting;
+  };
+
+  // A fragmented inbound frame being put back together.
+  struct Reassembly {
+    BufferPool::Buffer buffer;
+    std::size_t size = 0;
+    std::size_t filled = 0;
+  };
+
+  void Enqueue(Frame frame, uint32_t topic_id = kNoTopic,
+               const BatchOptions& batching = BatchOptions(),
+               Priority priority = Priority::kHigh);
+  bool HasQueuedFrames() const;
+  void ArmBatchTimer(std::chrono::steady_clock::time_point deadline);
+  void HandleBatchTimer(const boost::system::error_code& error);
+  void ArmHeartbeatTimer();
+  void HandleHeartbeatTimer(const boost::system::error_code& error);
+  bool OverLimit(uint32_t topic_id, std::size_t size,
+                 const QueueLimits& topic_limits) const;
+  bool DropOldest(uint32_t topic_id);
+  void Dequeue(const QueuedFrame& queued);
+  void EraseWaiting(std::size_t lane, std::size_t first, std::size_t count);
+  void ClearQueue();
+  void ReportThrottle();
+  void Receive();
+  void StartWriting();
+  void Write();
+  void StopWaiting(std::size_t lane);
+  void TakeHead(std::size_t lane);
+  std::size_t TakeBatch(std::size_t lane, std::size_t limit);
+  std::size_t TakeFragment(std::size_t lane);
+  void HandleWrite(const boost::system::error_code& error);
+  void HandleRead(const boost::system::error_code& error, std::size_t size);
+  bool Reassemble(ByteReader& reader);
+  void Fail(const boost::system::error_code& error);
+
+  boost::asio::ip::tcp::socket socket_;
+  boost::asio::io_context::strand strand_;
+  std::shared_ptr<BufferPool> buffer_pool_;
+  std::size_t max_write_size_;
+  std::array<Lane, kLaneCount> lanes_;
+  std::vector<QueuedFrame> writing_frames_;
+  std::vector<boost::asio::const_buffer> writing_buffers_;
+  // Frames built for the write in flight, batches and fragment headers, and
+  // frames only partly covered by it.
+  std::vector<Frame> writing_extra_;
+  HandlerMemory start_writing_memory_;
+  HandlerMemory write_memory_;
+  HandlerMemory read_memory_;
+  HandlerMemory batch_timer_memory_;
+  HandlerMemory heartbeat_timer_memory_;
+  std::vector<TopicQueue> topic_queues_;
+  QueueLimits queue_limits_;
+  std::size_t queued_bytes_;
+  std::size_t queued_messages_;
+  uint64_t throttled_count_;
+  uint64_t dropped_count_;
+  uint64_t conflated_count_;
+  uint64_t batch_count_;
+  uint64_t batched_count_;
+  BatchOptions batch_options_;
+  boost::asio::steady_timer batch_timer_;
+  std::chrono::steady_clock::time_point batch_deadline_;
+  bool batch_timer_armed_;
+  // Bytes of batched frames queued since the writer last went idle.
+  std::size_t batch_bytes_;
+  boost::asio::steady_timer heartbeat_timer_;
+  std::chrono::milliseconds heartbeat_interval_;
+  unsigned heartbeat_misses_;
+  // Intervals in a row without anything from the peer, and whether
+  // anything has arrived in the current one.
+  unsigned missed_heartbeats_;
+  bool received_since_heartbeat_;
+  bool throttled_;
+  bool throttle_reported_;
+  std::condition_variable space_available_;
+  std::unordered_map<uint32_t, std::string> remote_topics_;
+  BufferPool::Buffer receive_buffer_;
+  std::size_t receive_begin_;
+  std::size_t receive_end_;
+  std::size_t receive_needed_;
+  std::array<Reassembly, kLaneCount> reassemblies_;
+  std::atomic<std::size_t> max_message_size_;
+  FrameHandler frame_handler_;
+  bool writing_;
+  bool closed_;
+  ErrorHandler error_handler_;
+  ThrottleHandler throttle_handler_;
+  std::mutex mutex_;
+};
+
+}  // namespace farfler::network
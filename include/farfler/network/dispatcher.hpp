@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+namespace farfler::network {
+
+// The queue behind one online subscription. Tasks run one at a time, in the
+// order they were posted, on the dispatcher's executor. A conflating queue
+// holds at most one task: posting while one is waiting replaces it. Once
+// stopped, tasks still in the queue are dropped instead of run.
+class DispatchQueue : public std::enable_shared_from_this<DispatchQueue> {
+ public:
+  DispatchQueue(boost::asio::any_io_executor executor, bool conflate);
+
+  template <typename Task>
+  void Post(Task task);
+
+  std::size_t Depth() const;
+  void Stop();
+
+ private:
+  void RunLatest();
+
+  boost::asio::strand<boost::asio::any_io_executor> strand_;
+  std::atomic<std::size_t> depth_;
+  std::atomic<bool> stopped_;
+  bool conflate_;
+  std::function<void()> latest_;
+  std::mutex latest_mutex_;
+};
+
+// Where online subscriber callbacks run. Inline dispatch calls them on the
+// strand of the connection the message arrived on, so one slow callback holds
+// up that peer's socket and every topic behind it, and a subscription
+// receiving from several peers may be called from several threads at once.
+// The other modes give each subscription a DispatchQueue on a thread pool the
+// dispatcher owns or on an executor supplied by the caller, which keeps
+// socket I/O moving and runs each subscription's callbacks in order while
+// different subscriptions proceed in parallel.
+class Dispatcher {
+ public:
+  Dispatcher();
+  explicit Dispatcher(std::size_t threads);
+  explicit Dispatcher(boost::asio::any_io_executor executor);
+  Dispatcher(const Dispatcher&) = delete;
+  Dispatcher& operator=(const Dispatcher&) = delete;
+  ~Dispatcher();
+
+  // Returns null for inline dispatch.
+  std::shared_ptr<DispatchQueue> MakeQueue(bool conflate = false) const;
+
+ private:
+  std::unique_ptr<boost::asio::thread_pool> pool_;
+  boost::asio::any_io_executor executor_;
+};
+
+}  // namespace farfler::network
+
+#include "dispatcher.tpp"
@@ -0,0 +1,30 @@
+namespace farfler::network {
+
+template <typename Task>
+void DispatchQueue::Post(Task task) {
+  if (conflate_) {
+    {
+      std::lock_guard<std::mutex> lock(latest_mutex_);
+      bool waiting = static_cast<bool>(latest_);
+      latest_ = std::move(task);
+      if (waiting) {
+        return;
+      }
+    }
+    depth_.fetch_add(1, std::memory_order_relaxed);
+    boost::asio::post(strand_,
+                      [self = shared_from_this()]() { self->RunLatest(); });
+    return;
+  }
+
+  depth_.fetch_add(1, std::memory_order_relaxed);
+  boost::asio::post(strand_, [self = shared_from_this(),
+                              task = std::move(task)]() mutable {
+    if (!self->stopped_.load(std::memory_order_acquire)) {
+      task();
+    }
+    self->depth_.fetch_sub(1, std::memory_order_relaxed);
+  });
+}
+
+}  // namespace farfler::network
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace farfler::network {
+
+// A block of memory reused by one asynchronous operation at a time. The block
+// grows to the largest operation it has held and is then kept, so an object
+// with at most one read, write or post in flight can own one per operation
+// instead of relying on asio's per-thread recycling, which only exists on
+// threads running the io_context and only caches a couple of small blocks.
+// Falls back to the heap if the block is already taken.
+class HandlerMemory {
+ public:
+  HandlerMemory() : block_(nullptr), size_(0), in_use_(false) {}
+  HandlerMemory(const HandlerMemory&) = delete;
+  HandlerMemory& operator=(const HandlerMemory&) = delete;
+  ~HandlerMemory() { ::operator delete(block_); }
+
+  void* Allocate(std::size_t size) {
+    if (in_use_.exchange(true)) {
+      return ::operator new(size);
+    }
+    if (size > size_) {
+      ::operator delete(block_);
+      block_ = ::operator new(size);
+      size_ = size;
+    }
+    return block_;
+  }
+
+  void Deallocate(void* pointer) {
+    if (pointer == block_) {
+      in_use_.store(false);
+    } else {
+      ::operator delete(pointer);
+    }
+  }
+
+ private:
+  void* block_;
+  std::size_t size_;
+  std::atomic<bool> in_use_;
+};
+
+template <typename T>
+class HandlerAllocator {
+ public:
+  using value_type = T;
+
+  explicit HandlerAllocator(HandlerMemory& memory) : memory_(&memory) {}
+
+  template <typename U>
+  HandlerAllocator(const HandlerAllocator<U>& other) noexcept
+      : memory_(other.memory_) {}
+
+  T* allocate(std::size_t n) const {
+    return static_cast<T*>(memory_->Allocate(sizeof(T) * n));
+  }
+
+  void deallocate(T* pointer, std::size_t) const {
+    memory_->Deallocate(pointer);
+  }
+
+  bool operator==(const HandlerAllocator& other) const noexcept {
+    return memory_ == other.memory_;
+  }
+
+  bool operator!=(const HandlerAllocator& other) const noexcept {
+    return memory_ != other.memory_;
+  }
+
+ private:
+  template <typename>
+  friend class HandlerAllocator;
+
+  HandlerMemory* memory_;
+};
+
+// Wraps a handler so asio allocates its operation from the given memory.
+template <typename Handler>
+class AllocatingHandler {
+ public:
+  using allocator_type = HandlerAllocator<Handler>;
+
+  AllocatingHandler(HandlerMemory& memory, Handler handler)
+      : memory_(memory), handler_(std::move(handler)) {}
+
+  allocator_type get_allocator() const noexcept {
+    return allocator_type(memory_);
+  }
+
+  template <typename... Args>
+  void operator()(Args&&... args) {
+    handler_(std::forward<Args>(args)...);
+  }
+
+ private:
+  HandlerMemory& memory_;
+  Handler handler_;
+};
+
+template <typename Handler>
+AllocatingHandler<std::decay_t<Handler>> MakeAllocatingHandler(
+    HandlerMemory& memory, Handler&& handler) {
+  return AllocatingHandler<std::decay_t<Handler>>(
+      memory, std::forward<Handler>(handler));
+}
+
+}  // namespace farfler::network
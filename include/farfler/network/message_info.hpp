@@ -0,0 +1,31 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace farfler::network {
+
+// How online publications on a topic travel between nodes.
+enum class Transport : uint8_t {
+  // Reliable and ordered, sent once per subscribed peer.
+  kTcp = 0,
+  // Best effort: sent once to a multicast group derived from the topic,
+  // which subscribers join. Messages too large for a datagram go over TCP.
+  kMulticast = 1,
+  // Best effort: sent once per subscribed peer over the UDP data channel set
+  // up with it during the handshake, so a lost message never holds up the
+  // ones behind it. Messages too large for one unfragmented datagram, and
+  // those to peers without a data channel, go over TCP.
+  kUdp = 2,
+};
+
+// Describes how an online message reached its subscriber.
+struct MessageInfo {
+  Transport transport = Transport::kTcp;
+  // The publisher's per-topic sequence number and its clock when it sent
+  // the message. Only set for datagrams.
+  uint64_t sequence = 0;
+  std::chrono::system_clock::time_point sent_at;
+};
+
+}  // namespace farfler::network
@@ -1,22 +1,72 @@
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <boost/asio.hpp>
+#include <farfler/network/buffer_pool.hpp>
+#include <farfler/network/connection.hpp>
+#include <farfler/network/dispatcher.hpp>
+#include <farfler/network/message_info.hpp>
+#include <farfler/network/network_config.hpp>
 #include <farfler/network/pingpong.hpp>
+#include <farfler/network/protocol.hpp>
 #include <farfler/network/pubsub.hpp>
+#include <farfler/network/topic_options.hpp>
 #include <farfler/network/types.hpp>
 #include <iostream>
+#include <memory>
+#include <random>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace farfler::network {
 
+// A message about to be written into one or more frames. Types that can only
+// serialize themselves into a vector are encoded once, up front, rather than
+// once to size each frame and again to fill it.
+template <typename T>
+class EncodedMessage {
+ public:
+  explicit EncodedMessage(const T& message);
+
+  std::size_t Size() const;
+  void Serialize(ByteWriter& writer) const;
+
+ private:
+  const T& message_;
+  std::vector<char> packet_;
+};
+
 class Network {
  public:
+  using ThrottleCallback =
+      std::function<void(const std::string& peer_id, bool throttled)>;
+  using LivenessCallback =
+      std::function<void(const std::string& peer_id, bool alive)>;
+
+  struct DatagramStats {
+    uint64_t sent;
+    // Datagrams the socket would not take.
+    uint64_t dropped;
+    uint64_t received;
+    // Sequence numbers skipped, and datagrams discarded for arriving after
+    // a later one from the same publisher on the same topic.
+    uint64_t lost;
+    uint64_t late;
+  };
+
   Network(boost::asio::io_context& io_context, const std::string& name);
 
+  // Runs online subscriber callbacks through the given dispatcher instead of
+  // inline on the receiving connection's strand.
+  Network(boost::asio::io_context& io_context, const std::string& name,
+          std::shared_ptr<Dispatcher> dispatcher);
+
+  Network(boost::asio::io_context& io_context, const NetworkConfig& config);
+
   template <typename T>
   static void PublishOffline(const std::string& topic, const T& message);
 
@@ -25,18 +75,20 @@ class Network {
                              const T& message);
 
   template <typename T>
-  static void PublishOnline(const std::string& topic, const T& message);
+  static PublishStatus PublishOnline(const std::string& topic,
+                                     const T& message);
 
   template <typename T>
-  static void PublishOnline(Network& network, const std::string& topic,
-                            const T& message);
+  static PublishStatus PublishOnline(Network& network,
+                                     const std::string& topic,
+                                     const T& message);
 
   template <typename T>
-  static void Publish(const std::string& topic, const T& message);
+  static PublishStatus Publish(const std::string& topic, const T& message);
 
   template <typename T>
-  static void Publish(Network& network, const std::string& topic,
-                         const T& message);
+  static PublishStatus Publish(Network& network, const std::string& topic,
+                               const T& message);
 
   template <typename Callback>
   static Subscription SubscribeOffline(const std::string& topic,
@@ -47,6 +99,8 @@ class Network {
                                        const std::string& topic,
                                        Callback callback);
 
+  // The callback may take a const MessageInfo& after the message to learn
+  // which transport delivered it.
   template <typename Callback>
   static Subscription SubscribeOnline(const std::string& topic,
                                       Callback callback);
@@ -63,6 +117,8 @@ class Network {
   static Subscription Subscribe(Network& network, const std::string& topic,
                                    Callback callback);
 
+  // The subscription already knows its topic; the topic argument is kept for
+  // source compatibility and is not used to find it.
   static void UnsubscribeOffline(const std::string& topic,
                                  const Subscription& subscription);
 
@@ -81,37 +137,241 @@ class Network {
   static void Unsubscribe(Network& network, const std::string& topic,
                              const Subscription& subscription);
 
+  static void SetTopicOptions(const std::string& topic,
+                              const TopicOptions& options);
+
+  static void SetTopicOptions(Network& network, const std::string& topic,
+                              const TopicOptions& options);
+
+  // Limits on everything queued for one peer, across all topics.
+  static void SetPeerQueueLimits(const QueueLimits& limits);
+
+  static void SetPeerQueueLimits(Network& network, const QueueLimits& limits);
+
+  // Batching for publications to every peer, on topics whose options do not
+  // override it. Off by default.
+  static void SetPeerBatching(const BatchOptions& options);
+
+  static void SetPeerBatching(Network& network, const BatchOptions& options);
+
+  // Largest frame a peer may send, counting a fragmented frame as a whole. A
+  // peer that sends a larger one is disconnected. 64 MiB by default.
+  static void SetMaxMessageSize(std::size_t size);
+
+  static void SetMaxMessageSize(Network& network, std::size_t size);
+
+  // Called when a peer's send queue hits a limit and again once it has
+  // drained, from whichever thread noticed.
+  static void SetThrottleCallback(ThrottleCallback callback);
+
+  static void SetThrottleCallback(Network& network, ThrottleCallback callback);
+
+  // Called when a peer is verified and when it is lost, whether by an error,
+  // by missing heartbeats or by closing its connection. Calls are made from
+  // an io_context thread, in order.
+  static void SetLivenessCallback(LivenessCallback callback);
+
+  static void SetLivenessCallback(Network& network, LivenessCallback callback);
+
+  static Connection::QueueStats GetPeerQueueStats(const std::string& peer_id);
+
+  static Connection::QueueStats GetPeerQueueStats(Network& network,
+                                                  const std::string& peer_id);
+
+  // Messages waiting in an online subscription's dispatch queue. Always zero
+  // with inline dispatch.
+  static std::size_t GetQueueDepth(const Subscription& subscription);
+
+  static std::size_t GetQueueDepth(Network& network,
+                                   const Subscription& subscription);
+
+  static BufferPool::Stats GetBufferPoolStats();
+
+  static BufferPool::Stats GetBufferPoolStats(Network& network);
+
+  static DatagramStats GetMulticastStats();
+
+  static DatagramStats GetMulticastStats(Network& network);
+
+  // Datagrams sent to and received from one peer over its UDP data channel.
+  static DatagramStats GetUnicastStats(const std::string& peer_id);
+
+  static DatagramStats GetUnicastStats(Network& network,
+                                       const std::string& peer_id);
+
  private:
+  using UdpHandler = void (Network::*)(ByteReader&);
+  using TcpHandler = void (Network::*)(ByteReader&,
+                                       std::shared_ptr<Connection>);
+
+  static constexpr std::size_t kMaxDatagramSize = 65507;
+  // Unicast datagrams stay under common path MTUs, so they are never
+  // fragmented and one lost fragment never costs a whole message.
+  static constexpr std::size_t kMaxUnicastDatagramSize = 1200;
+  // How long a dial may take from resolving the peer's address to its
+  // TcpPong.
+  static constexpr std::chrono::seconds kConnectTimeout{5};
+
+  struct DatagramCounters {
+    DatagramStats Load() const;
+
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> received{0};
+    std::atomic<uint64_t> lost{0};
+    std::atomic<uint64_t> late{0};
+  };
+
+  // Discovered peers whose connection is lost are redialed this many times
+  // before they are left to discovery; static peers are redialed until they
+  // answer.
+  static constexpr unsigned kMaxRedials = 8;
+
+  // Where a dial this node made went, so it can be made again. Dials are
+  // filed under the peer's id, or under the address of a static peer until
+  // the peer's id is known.
+  struct DialTarget {
+    std::string key;
+    std::string host;
+    uint16_t port;
+    bool static_peer;
+    std::string peer_id;
+  };
+
+  // A verified peer's UDP data channel, learned from its TcpPong.
+  struct UdpPeer {
+    boost::asio::ip::udp::endpoint endpoint;
+    DatagramCounters counters;
+  };
+
+  // A topic this node publishes, interned to an id that is unique within
+  // this Network. The announcement frame binding the id to the topic string
+  // is built once and sent ahead of the first publication on each connection.
+  struct LocalTopic {
+    uint32_t id;
+    Frame announcement;
+    TopicOptions options;
+    std::shared_ptr<std::atomic<uint64_t>> datagram_sequence;
+  };
+
+  // The connections to verified peers subscribed to each topic.
+  using TopicRoutes =
+      std::unordered_map<std::string,
+                         std::vector<std::shared_ptr<Connection>>>;
+  // The data channels of the same peers, and the connections to those that
+  // have none.
+  struct UnicastRoute {
+    std::vector<std::shared_ptr<UdpPeer>> peers;
+    std::vector<std::shared_ptr<Connection>> unreachable;
+  };
+  using UnicastRoutes = std::unordered_map<std::string, UnicastRoute>;
+  // Whether any of the same peers joined each topic's multicast group, and
+  // the connections to those that did not.
+  struct MulticastRoute {
+    bool joined = false;
+    std::vector<std::shared_ptr<Connection>> unjoined;
+  };
+  using MulticastRoutes = std::unordered_map<std::string, MulticastRoute>;
+
   void InitializeUdpSocket();
   void InitializeTcpAcceptor();
+  void InitializeDatagramSockets();
+  void StartReceivingDatagrams(boost::asio::ip::udp::socket& socket,
+                               std::vector<char>& buffer, Transport transport);
+  void ProcessDatagram(ByteReader& reader, Transport transport);
   void StartReceivingUdpMessages();
   void StartAcceptingTcpConnections();
   void StartCyclingDiscoveryMessages();
-  void UdpBroadcast(const std::vector<char>& packet);
-  void ProcessUdpMessage(const std::vector<char>& packet);
-  void HandleUdpPing(std::vector<char>& packet);
-  void HandleUdpPong(std::vector<char>& packet);
-  void ConnectToPeer(const UdpPong& msg);
-  void StartReceivingTcpMessages(
-      std::shared_ptr<boost::asio::ip::tcp::socket> socket);
-  void HandleTcpError(std::shared_ptr<boost::asio::ip::tcp::socket> socket,
+  void DialStaticPeers();
+  void UdpBroadcast(Frame packet);
+  void UdpSend(Frame packet, const boost::asio::ip::udp::endpoint& endpoint);
+  void ProcessUdpMessage(ByteReader& reader);
+  void HandleUdpPing(ByteReader& reader);
+  void HandleUdpPong(ByteReader& reader);
+  void DiscoverPeer(const std::string& id, const std::string& tcp_address,
+                    uint16_t tcp_port);
+  void ConnectToPeer(const DialTarget& target);
+  void ScheduleRedial(const DialTarget& target);
+  bool StandBy(const DialTarget& target);
+  void NotifyLiveness(const std::string& peer_id, bool alive);
+  void ForgetDatagramSequences(const std::string& peer_id);
+  bool IsDialing(const std::string& id,
+                 const std::shared_ptr<Connection>& connection);
+  void Connect(std::shared_ptr<Connection> connection,
+               const std::vector<boost::asio::ip::tcp::endpoint>& endpoints);
+  std::shared_ptr<Connection> MakeConnection(
+      boost::asio::ip::tcp::socket socket);
+  void CloseDuplicate(const std::string& id,
+                      const std::shared_ptr<Connection>& connection);
+  bool RegisterConnection(const std::string& id,
+                          std::shared_ptr<Connection> connection, bool dialed,
+                          uint16_t data_port);
+  void HandleTcpError(std::shared_ptr<Connection> connection,
                       const boost::system::error_code& error);
-  void ProcessTcpMessage(const std::vector<char>& packet,
-                         std::shared_ptr<boost::asio::ip::tcp::socket> socket);
-  void HandleTcpPing(std::vector<char>& packet,
-                     std::shared_ptr<boost::asio::ip::tcp::socket> socket);
-  void HandleTcpPong(std::vector<char>& packet,
-                     std::shared_ptr<boost::asio::ip::tcp::socket> socket);
-  void HandlePublication(std::vector<char>& packet);
-  void UpdatePeerSubscriptions(const std::string& peer_id,
-                               const std::vector<std::string>& topics);
-  void SendTcpPing(std::shared_ptr<boost::asio::ip::tcp::socket> socket);
-  void SendTcpMessage(std::shared_ptr<boost::asio::ip::tcp::socket> socket,
-                      const std::vector<char>& message);
-  void SendPublication(std::shared_ptr<boost::asio::ip::tcp::socket> socket,
-                       const std::string& topic,
-                       const std::vector<char>& message);
+  void HandleThrottle(std::shared_ptr<Connection> connection, bool throttled);
+  void RemoveConnection(std::shared_ptr<Connection> connection);
+  bool CheckFrameHeader(const FrameHeader& header, const ByteReader& packet,
+                        const char* transport);
+  void ProcessTcpMessage(ByteReader& reader,
+                         std::shared_ptr<Connection> connection);
+  void HandleTcpPing(ByteReader& reader,
+                     std::shared_ptr<Connection> connection);
+  void HandleTcpPong(ByteReader& reader,
+                     std::shared_ptr<Connection> connection);
+  void HandleTopic(ByteReader& reader, std::shared_ptr<Connection> connection);
+  void HandlePublication(ByteReader& reader,
+                         std::shared_ptr<Connection> connection);
+  void HandleBatch(ByteReader& reader, std::shared_ptr<Connection> connection);
+  void UpdatePeerSubscriptions(
+      const std::string& peer_id, const std::vector<std::string>& topics,
+      const std::vector<std::string>& multicast_topics);
+  void RemovePeerSubscriptions(const std::string& peer_id);
+  void UpdateTopicRoutes();
+  bool HasRemoteSubscribers(const std::string& topic);
+  LocalTopic InternTopic(const std::string& topic);
+  TopicOptions FindTopicOptions(const std::string& topic);
+  PublishStatus SendToSubscribers(const std::string& topic,
+                                  const LocalTopic& local_topic,
+                                  const Frame& frame);
+  PublishStatus SendPublication(
+      const std::vector<std::shared_ptr<Connection>>& connections,
+      const LocalTopic& local_topic, const Frame& frame);
+  void SendTcpPing(std::shared_ptr<Connection> connection);
   void BroadcastSubscriptionUpdate();
+  void StopDispatchQueue(const Subscription& subscription);
+  bool OpenMulticastSocket();
+  void JoinMulticastGroup(const std::string& topic,
+                          const Subscription& subscription);
+  void LeaveMulticastGroup(const Subscription& subscription);
+  void UpdateJoinedMulticastTopics();
+  std::vector<std::shared_ptr<Connection>> SendMulticast(
+      const std::string& topic, const Frame& datagram);
+  std::vector<std::shared_ptr<Connection>> SendUnicast(
+      const std::string& topic, const Frame& datagram);
+  void SendDatagram(const Frame& datagram,
+                    const boost::asio::ip::udp::endpoint& endpoint,
+                    DatagramCounters& counters);
+  static boost::asio::ip::address_v4 MulticastGroup(const std::string& topic);
+
+  template <typename T>
+  Frame EncodeDatagramPublication(const std::string& topic,
+                                  const LocalTopic& local_topic,
+                                  const EncodedMessage<T>& message,
+                                  std::size_t max_size);
+
+  template <typename T>
+  Frame EncodeFrame(MessageKind kind, const T& msg);
+
+  template <typename T>
+  Frame EncodeDatagram(MessageKind kind, const T& msg);
+
+  template <typename T>
+  Frame EncodePublication(uint32_t topic_id,
+                          const EncodedMessage<T>& message);
+
+  template <typename T, typename Callback>
+  static std::function<void(ByteReader, const MessageInfo&)>
+  MakeOnlineCallback(Callback callback, std::shared_ptr<DispatchQueue> queue);
 
   template <typename Callback, typename T>
   static Subscription SubscribeOfflineImpl(Network& network,
@@ -125,31 +385,98 @@ class Network {
                                           Callback callback,
                                           void (Callback::*)(const T&) const);
 
+  template <typename Callback, typename T>
+  static Subscription SubscribeOnlineImpl(
+      Network& network, const std::string& topic, Callback callback,
+      void (Callback::*)(const T&, const MessageInfo&) const);
+
   template <typename Callback, typename T>
   static Subscription SubscribeAllImpl(Network& network,
                                        const std::string& topic,
                                        Callback callback,
                                        void (Callback::*)(const T&) const);
 
-  Network(boost::asio::io_context& io_context, const std::string& name, bool);
+  Network(boost::asio::io_context& io_context, const NetworkConfig& config,
+          bool);
 
   boost::asio::io_context& io_context_;
+  NetworkConfig config_;
   boost::asio::ip::udp::socket udp_socket_;
   boost::asio::ip::tcp::acceptor tcp_acceptor_;
+  boost::asio::ip::udp::socket multicast_socket_;
+  boost::asio::ip::udp::socket unicast_socket_;
+  boost::asio::ip::udp::socket datagram_send_socket_;
+  boost::asio::ip::udp::endpoint datagram_endpoint_;
+  boost::asio::ip::udp::endpoint unicast_local_endpoint_;
   boost::asio::ip::udp::endpoint udp_endpoint_;
+  boost::asio::ip::udp::endpoint udp_local_endpoint_;
+  boost::asio::ip::tcp::endpoint tcp_local_endpoint_;
   boost::asio::steady_timer cycle_discovery_messages_timer_;
-  std::unordered_map<std::string, std::shared_ptr<boost::asio::ip::tcp::socket>>
-      connecting_tcp_sockets_;
-  std::unordered_map<std::string, std::shared_ptr<boost::asio::ip::tcp::socket>>
-      unverified_tcp_sockets_;
+  // Only touched on discovery_strand_.
+  std::chrono::milliseconds discovery_interval_;
+  std::unordered_map<std::string, std::shared_ptr<Connection>> connections_;
+  std::unordered_map<std::string, std::shared_ptr<Connection>>
+      unverified_connections_;
+  // Set whenever a peer is dialed, verified or lost, and cleared by the
+  // discovery cycle.
+  bool peer_set_changed_;
+  std::unordered_map<std::string, std::unordered_set<std::string>>
+      topic_peers_;
+  std::unordered_map<std::string, std::vector<std::string>> peer_topics_;
+  std::unordered_map<std::string, std::unordered_set<std::string>>
+      peer_multicast_topics_;
+  std::unordered_map<std::string, LocalTopic> local_topics_;
+  std::unordered_map<std::string, TopicOptions> topic_options_;
+  QueueLimits peer_queue_limits_;
+  BatchOptions peer_batch_options_;
+  // Read when connections are made, which is not always under
+  // connections_mutex_.
+  std::atomic<std::size_t> max_message_size_;
+  ThrottleCallback throttle_callback_;
+  LivenessCallback liveness_callback_;
+  // Dials by connection, and failed redials in a row by dial key, under
+  // connections_mutex_.
+  std::unordered_map<const Connection*, DialTarget> dial_targets_;
+  std::unordered_map<std::string, unsigned> redial_attempts_;
+  // Static dials whose peer is connected some other way, by peer id, under
+  // connections_mutex_.
+  std::unordered_multimap<std::string, DialTarget> standby_dials_;
+  std::mt19937 redial_jitter_;
+  std::shared_ptr<const TopicRoutes> topic_routes_;
+  std::unordered_map<std::string, std::shared_ptr<UdpPeer>> udp_peers_;
+  std::shared_ptr<const UnicastRoutes> unicast_routes_;
+  std::shared_ptr<const MulticastRoutes> multicast_routes_;
   std::array<char, 1024> recv_buffer_;
+  std::vector<char> multicast_buffer_;
+  std::vector<char> unicast_buffer_;
+  // The next sequence number expected from each publisher on each topic and
+  // transport. Only touched on datagram_strand_.
+  std::unordered_map<std::string, uint64_t> datagram_next_sequence_;
+  // Group and topic memberships and the topic each subscription joined,
+  // under pubsub_mutex_.
+  std::unordered_map<uint32_t, std::size_t> multicast_group_members_;
+  std::unordered_map<std::string, std::size_t> multicast_topic_members_;
+  std::unordered_map<uint64_t, std::string> multicast_subscriptions_;
+  // The topics joined, as advertised to peers, which read it without the
+  // lock.
+  std::shared_ptr<const std::vector<std::string>> joined_multicast_topics_;
+  DatagramCounters multicast_counters_;
   std::string id_;
   std::string name_;
+  std::shared_ptr<Dispatcher> dispatcher_;
+  std::unordered_map<uint64_t, std::shared_ptr<DispatchQueue>>
+      dispatch_queues_;
   PubSub pubsub_;
-  std::mutex tcp_sockets_mutex_;
+  std::shared_ptr<BufferPool> buffer_pool_;
+  std::mutex connections_mutex_;
+  std::mutex local_topics_mutex_;
   std::mutex pubsub_mutex_;
-  boost::asio::io_context::strand strand_;
+  std::mutex datagram_send_mutex_;
+  boost::asio::io_context::strand discovery_strand_;
+  boost::asio::io_context::strand datagram_strand_;
   static std::unique_ptr<Network> instance;
+  static const std::array<UdpHandler, 256> udp_handlers_;
+  static const std::array<TcpHandler, 256> tcp_handlers_;
 };
 
 }  // namespace farfler::network
@@ -13,46 +13,173 @@ void Network::PublishOffline(const std::string& topic, const T& message) {
 template <typename T>
 void Network::PublishOffline(Network& network, const std::string& topic,
                              const T& message) {
-  std::vector<char> serialized = Serialize(message);
-  std::lock_guard<std::mutex> lock(network.pubsub_mutex_);
-  network.pubsub_.PublishOffline(topic, serialized);
+  network.pubsub_.PublishOffline(topic, message);
 }
 
 template <typename T>
-void Network::PublishOnline(const std::string& topic, const T& message) {
+PublishStatus Network::PublishOnline(const std::string& topic,
+                                     const T& message) {
   if (!instance) {
     std::cout << "Initialize a network instance first" << std::endl;
-    return;
+    return PublishStatus::kOk;
   }
 
-  PublishOnline(*instance, topic, message);
+  return PublishOnline(*instance, topic, message);
 }
 
 template <typename T>
-void Network::PublishOnline(Network& network, const std::string& topic,
-                            const T& message) {
-  std::vector<char> serialized = Serialize(message);
-  std::lock_guard<std::mutex> lock(network.tcp_sockets_mutex_);
-  for (const auto& [id, socket] : network.connecting_tcp_sockets_) {
-    network.SendPublication(socket, topic, serialized);
+PublishStatus Network::PublishOnline(Network& network,
+                                     const std::string& topic,
+                                     const T& message) {
+  if (!network.HasRemoteSubscribers(topic)) {
+    return PublishStatus::kOk;
+  }
+
+  LocalTopic local_topic = network.InternTopic(topic);
+  EncodedMessage<T> encoded(message);
+  if (local_topic.options.transport == Transport::kMulticast) {
+    Frame datagram = network.EncodeDatagramPublication(
+        topic, local_topic, encoded, kMaxDatagramSize);
+    if (datagram) {
+      std::vector<std::shared_ptr<Connection>> unjoined =
+          network.SendMulticast(topic, datagram);
+      if (unjoined.empty()) {
+        return PublishStatus::kOk;
+      }
+      return network.SendPublication(
+          unjoined, local_topic,
+          network.EncodePublication(local_topic.id, encoded));
+    }
+  } else if (local_topic.options.transport == Transport::kUdp) {
+    Frame datagram = network.EncodeDatagramPublication(
+        topic, local_topic, encoded, kMaxUnicastDatagramSize);
+    if (datagram) {
+      std::vector<std::shared_ptr<Connection>> unreachable =
+          network.SendUnicast(topic, datagram);
+      if (unreachable.empty()) {
+        return PublishStatus::kOk;
+      }
+      return network.SendPublication(
+          unreachable, local_topic,
+          network.EncodePublication(local_topic.id, encoded));
+    }
   }
+  return network.SendToSubscribers(
+      topic, local_topic, network.EncodePublication(local_topic.id, encoded));
 }
 
 template <typename T>
-void Network::Publish(const std::string& topic, const T& message) {
+PublishStatus Network::Publish(const std::string& topic, const T& message) {
   if (!instance) {
     std::cout << "Initialize a network instance first" << std::endl;
-    return;
+    return PublishStatus::kOk;
   }
 
-  Publish(*instance, topic, message);
+  return Publish(*instance, topic, message);
 }
 
 template <typename T>
-void Network::Publish(Network& network, const std::string& topic,
-                         const T& message) {
+PublishStatus Network::Publish(Network& network, const std::string& topic,
+                               const T& message) {
   PublishOffline<T>(network, topic, message);
-  PublishOnline<T>(network, topic, message);
+  return PublishOnline<T>(network, topic, message);
+}
+
+template <typename T>
+Frame Network::EncodeFrame(MessageKind kind, const T& msg) {
+  FrameHeader header(kind);
+  uint32_t packet_size =
+      FrameHeader::EncodedSize(header) + T::EncodedSize(msg);
+  Frame frame =
+      buffer_pool_->Acquire(UInt32::EncodedSize(packet_size) + packet_size);
+  ByteWriter writer(*frame);
+  UInt32::Serialize(packet_size, writer);
+  FrameHeader::Serialize(header, writer);
+  T::Serialize(msg, writer);
+  return frame;
+}
+
+template <typename T>
+Frame Network::EncodeDatagram(MessageKind kind, const T& msg) {
+  FrameHeader header(kind);
+  Frame packet = buffer_pool_->Acquire(
+      FrameHeader::EncodedDatagramSize(header) + T::EncodedSize(msg));
+  ByteWriter writer(*packet);
+  FrameHeader::SerializeDatagram(header, writer);
+  T::Serialize(msg, writer);
+  return packet;
+}
+
+template <typename T>
+Frame Network::EncodePublication(uint32_t topic_id,
+                                 const EncodedMessage<T>& message) {
+  FrameHeader header(MessageKind::kPublication);
+  uint32_t packet_size = FrameHeader::EncodedSize(header) +
+                         VarUInt32::EncodedSize(topic_id) +
+                         message.Size();
+  Frame frame =
+      buffer_pool_->Acquire(UInt32::EncodedSize(packet_size) + packet_size);
+  ByteWriter writer(*frame);
+  UInt32::Serialize(packet_size, writer);
+  FrameHeader::Serialize(header, writer);
+  VarUInt32::Serialize(topic_id, writer);
+  message.Serialize(writer);
+  return frame;
+}
+
+// Returns an empty frame, leaving the message to TCP, if the datagram would
+// be larger than max_size. Only datagrams that are built take a sequence
+// number, so messages sent over TCP instead never count as lost.
+template <typename T>
+Frame Network::EncodeDatagramPublication(const std::string& topic,
+                                         const LocalTopic& local_topic,
+                                         const EncodedMessage<T>& message,
+                                         std::size_t max_size) {
+  FrameHeader header(MessageKind::kDatagramPublication);
+  std::size_t size = FrameHeader::EncodedDatagramSize(header) +
+                     String::EncodedSize(id_) + String::EncodedSize(topic) +
+                     UInt64::EncodedSize(0) + Int64::EncodedSize(0) +
+                     message.Size();
+  if (size > max_size) {
+    return Frame();
+  }
+
+  Frame datagram = buffer_pool_->Acquire(size);
+  ByteWriter writer(*datagram);
+  FrameHeader::SerializeDatagram(header, writer);
+  String::Serialize(id_, writer);
+  String::Serialize(topic, writer);
+  UInt64::Serialize(local_topic.datagram_sequence->fetch_add(1), writer);
+  Int64::Serialize(std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count(),
+                   writer);
+  message.Serialize(writer);
+  return datagram;
+}
+
+// With a dispatch queue the message is still decoded here, on the receiving
+// connection's strand, so the queued task owns its copy and the receive
+// buffer can be reused straight away.
+template <typename T, typename Callback>
+std::function<void(ByteReader, const MessageInfo&)>
+Network::MakeOnlineCallback(Callback callback,
+                            std::shared_ptr<DispatchQueue> queue) {
+  if (!queue) {
+    return [callback](ByteReader serialized, const MessageInfo& info) {
+      T deserialized = Deserialize<T>(serialized);
+      callback(deserialized, info);
+    };
+  }
+
+  auto shared_callback = std::make_shared<Callback>(std::move(callback));
+  return [shared_callback, queue](ByteReader serialized,
+                                  const MessageInfo& info) {
+    queue->Post([shared_callback, info,
+                 deserialized = Deserialize<T>(serialized)]() {
+      (*shared_callback)(deserialized, info);
+    });
+  };
 }
 
 template <typename Callback, typename T>
@@ -61,12 +188,7 @@ Subscription Network::SubscribeOfflineImpl(Network& network,
                                            Callback callback,
                                            void (Callback::*)(const T&) const) {
   std::lock_guard<std::mutex> lock(network.pubsub_mutex_);
-  return network.pubsub_.SubscribeOffline(
-      topic, [callback](const std::vector<char>& serialized) {
-        std::vector<char> mutable_serialized = serialized;
-        T deserialized = Deserialize<T>(mutable_serialized);
-        callback(deserialized);
-      });
+  return network.pubsub_.SubscribeOffline<T>(topic, callback);
 }
 
 template <typename Callback, typename T>
@@ -74,13 +196,29 @@ Subscription Network::SubscribeOnlineImpl(Network& network,
                                           const std::string& topic,
                                           Callback callback,
                                           void (Callback::*)(const T&) const) {
+  auto with_info = [callback](const T& message, const MessageInfo&) {
+    callback(message);
+  };
+  return SubscribeOnlineImpl(network, topic, with_info,
+                             &decltype(with_info)::operator());
+}
+
+template <typename Callback, typename T>
+Subscription Network::SubscribeOnlineImpl(
+    Network& network, const std::string& topic, Callback callback,
+    void (Callback::*)(const T&, const MessageInfo&) const) {
   std::lock_guard<std::mutex> lock(network.pubsub_mutex_);
+  TopicOptions options = network.FindTopicOptions(topic);
+  std::shared_ptr<DispatchQueue> queue =
+      network.dispatcher_->MakeQueue(options.conflate);
   Subscription subscription = network.pubsub_.SubscribeOnline(
-      topic, [callback](const std::vector<char>& serialized) {
-        std::vector<char> mutable_serialized = serialized;
-        T deserialized = Deserialize<T>(mutable_serialized);
-        callback(deserialized);
-      });
+      topic, MakeOnlineCallback<T>(callback, queue));
+  if (queue) {
+    network.dispatch_queues_[subscription.id_] = queue;
+  }
+  if (options.transport == Transport::kMulticast) {
+    network.JoinMulticastGroup(topic, subscription);
+  }
   network.BroadcastSubscriptionUpdate();
   return subscription;
 }
@@ -91,12 +229,20 @@ Subscription Network::SubscribeAllImpl(Network& network,
                                        Callback callback,
                                        void (Callback::*)(const T&) const) {
   std::lock_guard<std::mutex> lock(network.pubsub_mutex_);
-  Subscription subscription = network.pubsub_.Subscribe(
-      topic, [callback](const std::vector<char>& serialized) {
-        std::vector<char> mutable_serialized = serialized;
-        T deserialized = Deserialize<T>(mutable_serialized);
-        callback(deserialized);
-      });
+  TopicOptions options = network.FindTopicOptions(topic);
+  std::shared_ptr<DispatchQueue> queue =
+      network.dispatcher_->MakeQueue(options.conflate);
+  auto with_info = [callback](const T& message, const MessageInfo&) {
+    callback(message);
+  };
+  Subscription subscription = network.pubsub_.Subscribe<T>(
+      topic, callback, MakeOnlineCallback<T>(with_info, queue));
+  if (queue) {
+    network.dispatch_queues_[subscription.id_] = queue;
+  }
+  if (options.transport == Transport::kMulticast) {
+    network.JoinMulticastGroup(topic, subscription);
+  }
   network.BroadcastSubscriptionUpdate();
   return subscription;
 }
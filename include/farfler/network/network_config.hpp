@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <farfler/network/dispatcher.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace farfler::network {
+
+// How a Network binds its sockets and finds its peers.
+struct NetworkConfig {
+  std::string name;
+  // The TCP listener and the unicast data socket bind to this address, which
+  // is also what pings advertise. Discovery and multicast sockets bind to
+  // every interface so they still receive broadcasts and groups.
+  std::string bind_address = "0.0.0.0";
+  // Zero picks a free port.
+  uint16_t tcp_port = 0;
+  uint16_t data_port = 0;
+  // Shared by every node on the segment.
+  uint16_t discovery_port = 21075;
+  uint16_t multicast_port = 21076;
+  // Broadcast pings and answer them. Without discovery the node only talks
+  // to its static peers and to peers that dial it, and sends no broadcasts.
+  bool discovery = true;
+  // Pings go out this often while peers come and go, backing off to the
+  // maximum once the set of peers has settled.
+  std::chrono::milliseconds discovery_interval{250};
+  std::chrono::milliseconds max_discovery_interval{8000};
+  // Heartbeats go out on every connection this often, and a peer that has
+  // not been heard from for this many intervals in a row is dropped. A zero
+  // interval turns heartbeats off.
+  std::chrono::milliseconds heartbeat_interval{1000};
+  unsigned heartbeat_misses = 3;
+  // Lost peers this node dialed are dialed again after a delay that starts
+  // here and doubles with each failed attempt, up to the maximum.
+  std::chrono::milliseconds reconnect_delay{100};
+  std::chrono::milliseconds max_reconnect_delay{10000};
+  // "host:port" of peers' TCP listeners, dialed as soon as the network is
+  // constructed.
+  std::vector<std::string> static_peers;
+  // Null runs online subscriber callbacks inline.
+  std::shared_ptr<Dispatcher> dispatcher;
+};
+
+}  // namespace farfler::network
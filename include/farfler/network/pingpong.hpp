@@ -12,11 +12,15 @@ class UdpPing {
           const std::string& udp_address = "", uint16_t udp_port = 0,
           const std::string& tcp_address = "", uint16_t tcp_port = 0);
 
+  static std::size_t EncodedSize(const UdpPing& msg);
   static std::vector<char> Serialize(const UdpPing& msg);
-  static std::vector<char> Serialize(const UdpPing& msg,
-                                     std::vector<char>& packet);
+  static std::vector<char>& Serialize(const UdpPing& msg,
+                                      std::vector<char>& packet);
+  static void Serialize(const UdpPing& msg, ByteWriter& writer);
   static UdpPing Deserialize(std::vector<char>& packet);
   static UdpPing Deserialize(std::vector<char>& packet, UdpPing& msg);
+  static UdpPing Deserialize(ByteReader& reader);
+  static UdpPing Deserialize(ByteReader& reader, UdpPing& msg);
 
   std::string id_;
   std::string name_;
@@ -32,11 +36,15 @@ class UdpPong {
           const std::string& udp_address = "", uint16_t udp_port = 0,
           const std::string& tcp_address = "", uint16_t tcp_port = 0);
 
+  static std::size_t EncodedSize(const UdpPong& msg);
   static std::vector<char> Serialize(const UdpPong& msg);
-  static std::vector<char> Serialize(const UdpPong& msg,
-                                     std::vector<char>& packet);
+  static std::vector<char>& Serialize(const UdpPong& msg,
+                                      std::vector<char>& packet);
+  static void Serialize(const UdpPong& msg, ByteWriter& writer);
   static UdpPong Deserialize(std::vector<char>& packet);
   static UdpPong Deserialize(std::vector<char>& packet, UdpPong& msg);
+  static UdpPong Deserialize(ByteReader& reader);
+  static UdpPong Deserialize(ByteReader& reader, UdpPong& msg);
 
   std::string id_;
   std::string name_;
@@ -52,11 +60,15 @@ class TcpPing {
           const std::string& udp_address = "", uint16_t udp_port = 0,
           const std::string& tcp_address = "", uint16_t tcp_port = 0);
 
+  static std::size_t EncodedSize(const TcpPing& msg);
   static std::vector<char> Serialize(const TcpPing& msg);
-  static std::vector<char> Serialize(const TcpPing& msg,
-                                     std::vector<char>& packet);
+  static std::vector<char>& Serialize(const TcpPing& msg,
+                                      std::vector<char>& packet);
+  static void Serialize(const TcpPing& msg, ByteWriter& writer);
   static TcpPing Deserialize(std::vector<char>& packet);
   static TcpPing Deserialize(std::vector<char>& packet, TcpPing& msg);
+  static TcpPing Deserialize(ByteReader& reader);
+  static TcpPing Deserialize(ByteReader& reader, TcpPing& msg);
 
   std::string id_;
   std::string name_;
@@ -64,7 +76,12 @@ class TcpPing {
   uint16_t udp_port_;
   std::string tcp_address_;
   uint16_t tcp_port_;
+  // Port of the sender's UDP data channel, on the address the TCP
+  // connection comes from.
+  uint16_t data_port_;
   std::vector<std::string> subscribed_topics_;
+  // Those of the subscribed topics whose multicast group the sender joined.
+  std::vector<std::string> multicast_topics_;
 };
 
 class TcpPong {
@@ -73,11 +90,15 @@ class TcpPong {
           const std::string& udp_address = "", uint16_t udp_port = 0,
           const std::string& tcp_address = "", uint16_t tcp_port = 0);
 
+  static std::size_t EncodedSize(const TcpPong& msg);
   static std::vector<char> Serialize(const TcpPong& msg);
-  static std::vector<char> Serialize(const TcpPong& msg,
-                                     std::vector<char>& packet);
+  static std::vector<char>& Serialize(const TcpPong& msg,
+                                      std::vector<char>& packet);
+  static void Serialize(const TcpPong& msg, ByteWriter& writer);
   static TcpPong Deserialize(std::vector<char>& packet);
   static TcpPong Deserialize(std::vector<char>& packet, TcpPong& msg);
+  static TcpPong Deserialize(ByteReader& reader);
+  static TcpPong Deserialize(ByteReader& reader, TcpPong& msg);
 
   std::string id_;
   std::string name_;
@@ -85,7 +106,12 @@ class TcpPong {
   uint16_t udp_port_;
   std::string tcp_address_;
   uint16_t tcp_port_;
+  // Port of the sender's UDP data channel, on the address the TCP
+  // connection comes from.
+  uint16_t data_port_;
   std::vector<std::string> subscribed_topics_;
+  // Those of the subscribed topics whose multicast group the sender joined.
+  std::vector<std::string> multicast_topics_;
 };
 
 }  // namespace farfler::network
\ No newline at end of file
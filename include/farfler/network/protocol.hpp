@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <farfler/network/stream.hpp>
+
+namespace farfler::network {
+
+constexpr uint8_t kProtocolMagic = 0xFA;
+constexpr uint8_t kProtocolVersion = 2;
+// Precedes the FrameHeader of every UDP datagram as a length-prefixed string,
+// the way the legacy protocol sends its tags, so a legacy node that hears a
+// broadcast reads a tag it does not know rather than a length that runs past
+// the datagram. Legacy nodes never get a TCP connection, so frames need none.
+constexpr std::array<char, 4> kDatagramTag = {'f', 'a', 'r', 'f'};
+
+// Identifies the body that follows a FrameHeader. Values are part of the
+// wire format; new kinds (batch, heartbeat, ...) take the next free value and
+// peers that do not know a kind skip the frame.
+enum class MessageKind : uint8_t {
+  kUdpPing = 0,
+  kUdpPong = 1,
+  kTcpPing = 2,
+  kTcpPong = 3,
+  // Binds a sender-local topic id to its topic string: varint id, topic.
+  kTopic = 4,
+  // Publication on a previously announced topic: varint id, payload.
+  kPublication = 5,
+  // Publications packed together: repeated varint size, publication body.
+  kBatch = 6,
+  // Publication sent as a multicast or unicast datagram: publisher id,
+  // topic, sequence number, send time in microseconds, payload.
+  kDatagramPublication = 7,
+  // One chunk of a frame too large to send whole: varint lane, UInt32 size
+  // of the whole frame body, chunk.
+  kFragment = 8,
+  // Sent every heartbeat interval while no other write is in flight; no
+  // body.
+  kHeartbeat = 9,
+};
+
+// Prefix of every TCP frame body, and of every UDP datagram after its tag.
+class FrameHeader {
+ public:
+  FrameHeader(MessageKind kind = MessageKind::kUdpPing);
+
+  static std::size_t EncodedSize(const FrameHeader& msg);
+  static void Serialize(const FrameHeader& msg, ByteWriter& writer);
+  static FrameHeader Deserialize(ByteReader& reader);
+  static FrameHeader Deserialize(ByteReader& reader, FrameHeader& msg);
+
+  // The same with the datagram tag in front. A datagram without the tag
+  // reads as a header with a cleared magic byte.
+  static std::size_t EncodedDatagramSize(const FrameHeader& msg);
+  static void SerializeDatagram(const FrameHeader& msg, ByteWriter& writer);
+  static FrameHeader DeserializeDatagram(ByteReader& reader);
+
+  // True if the bytes look like the string-tagged protocol ("udp_ping",
+  // "publication", ...) that predates FrameHeader.
+  static bool IsLegacy(ByteReader reader);
+
+  uint8_t magic_;
+  uint8_t version_;
+  MessageKind kind_;
+};
+
+}  // namespace farfler::network
@@ -1,62 +1,89 @@
 #pragma once
 
-#include <boost/uuid/uuid.hpp>
-#include <boost/uuid/uuid_generators.hpp>
-#include <boost/uuid/uuid_io.hpp>
+#include <cstdint>
+#include <farfler/network/message_info.hpp>
+#include <farfler/network/stream.hpp>
+#include <farfler/network/subscribers.hpp>
 #include <functional>
 #include <mutex>
 #include <string>
+#include <typeindex>
 #include <unordered_map>
 #include <vector>
 
 namespace farfler::network {
 
+// Handle to a subscription: the slot it occupies in its PubSub in the low 32
+// bits and the slot's generation in the high 32 bits, so a stale handle to a
+// reused slot is ignored. Zero is never a valid handle. The slot records the
+// subscription's topic, so unsubscribing never looks the topic up, but it
+// still copies the topic's other subscribers into a new snapshot.
 class Subscription {
  public:
-  explicit Subscription(const std::string& id = "");
-  std::string id_;
+  explicit Subscription(uint64_t id = 0);
+  uint64_t id_;
 };
 
 class PubSub {
  public:
-  template <typename Callback>
+  // Offline subscribers receive the publisher's object directly, without
+  // serialization. T must match the type published on the topic exactly.
+  template <typename T, typename Callback>
   Subscription SubscribeOffline(const std::string& topic, Callback callback);
 
   template <typename Callback>
   Subscription SubscribeOnline(const std::string& topic, Callback callback);
 
-  void UnsubscribeOffline(const std::string& topic,
-                          const Subscription& subscription);
-  void UnsubscribeOnline(const std::string& topic,
-                         const Subscription& subscription);
+  void UnsubscribeOffline(const Subscription& subscription);
+  void UnsubscribeOnline(const Subscription& subscription);
 
-  void PublishOffline(const std::string& topic,
-                      const std::vector<char>& message);
+  template <typename T>
+  void PublishOffline(const std::string& topic, const T& message);
+  void PublishOffline(const std::string& topic, std::type_index type,
+                      const void* message);
   void PublishOnline(const std::string& topic,
-                     const std::vector<char>& message);
+                     const std::vector<char>& message,
+                     const MessageInfo& info = MessageInfo());
+  void PublishOnline(const std::string& topic, const ByteReader& message,
+                     const MessageInfo& info = MessageInfo());
 
-  template <typename Callback>
-  Subscription Subscribe(const std::string& topic, Callback callback);
+  template <typename T, typename OfflineCallback, typename OnlineCallback>
+  Subscription Subscribe(const std::string& topic,
+                         OfflineCallback offline_callback,
+                         OnlineCallback online_callback);
 
-  void Unsubscribe(const std::string& topic,
-                      const Subscription& subscription);
+  void Unsubscribe(const Subscription& subscription);
 
   std::vector<std::string> GetOnlineSubscribedTopics() const;
 
  private:
-  std::string GenerateSubscriptionId();
-
-  std::unordered_map<
-      std::string,
-      std::unordered_map<std::string,
-                         std::function<void(const std::vector<char>&)>>>
-      offline_subscribers_;
-  std::unordered_map<
-      std::string,
-      std::unordered_map<std::string,
-                         std::function<void(const std::vector<char>&)>>>
-      online_subscribers_;
-  mutable std::mutex mutex_;
+  struct OfflineSubscriber {
+    std::type_index type;
+    std::function<void(const void*)> callback;
+  };
+  using OnlineSubscriber = std::function<void(ByteReader, const MessageInfo&)>;
+
+  // The topic the subscription is in on each side, if any.
+  struct SubscriptionSlot {
+    uint32_t generation;
+    std::shared_ptr<SubscriberTable<OfflineSubscriber>::Slot> offline;
+    std::shared_ptr<SubscriberTable<OnlineSubscriber>::Slot> online;
+  };
+
+  template <typename T, typename Callback>
+  static OfflineSubscriber MakeOfflineSubscriber(Callback callback);
+
+  uint64_t AcquireSubscription();
+  SubscriptionSlot& GetSubscription(uint64_t id);
+  void ReleaseSubscription(const Subscription& subscription, bool offline,
+                           bool online);
+
+  SubscriberTable<OfflineSubscriber> offline_subscribers_;
+  SubscriberTable<OnlineSubscriber> online_subscribers_;
+  std::vector<SubscriptionSlot> subscription_slots_;
+  std::vector<uint32_t> free_subscription_slots_;
+  // Serializes subscribe and unsubscribe; publishing never takes it.
+  std::mutex mutex_;
 };
 
 }  // namespace farfler::network
@@ -1,11 +1,19 @@
 namespace farfler::network {
 
-template <typename Callback>
+template <typename T, typename Callback>
+PubSub::OfflineSubscriber PubSub::MakeOfflineSubscriber(Callback callback) {
+  return OfflineSubscriber{typeid(T), [callback](const void* message) {
+                             callback(*static_cast<const T*>(message));
+                           }};
+}
+
+template <typename T, typename Callback>
 Subscription PubSub::SubscribeOffline(const std::string &topic,
                                       Callback callback) {
   std::lock_guard<std::mutex> lock(mutex_);
-  std::string id = GenerateSubscriptionId();
-  offline_subscribers_[topic][id] = callback;
+  uint64_t id = AcquireSubscription();
+  GetSubscription(id).offline =
+      offline_subscribers_.Add(topic, id, MakeOfflineSubscriber<T>(callback));
   return Subscription(id);
 }
 
@@ -13,18 +21,27 @@ template <typename Callback>
 Subscription PubSub::SubscribeOnline(const std::string &topic,
                                      Callback callback) {
   std::lock_guard<std::mutex> lock(mutex_);
-  std::string id = GenerateSubscriptionId();
-  online_subscribers_[topic][id] = callback;
+  uint64_t id = AcquireSubscription();
+  GetSubscription(id).online = online_subscribers_.Add(topic, id, callback);
   return Subscription(id);
 }
 
-template <typename Callback>
-Subscription PubSub::Subscribe(const std::string &topic, Callback callback) {
+template <typename T>
+void PubSub::PublishOffline(const std::string &topic, const T &message) {
+  PublishOffline(topic, typeid(T), &message);
+}
+
+template <typename T, typename OfflineCallback, typename OnlineCallback>
+Subscription PubSub::Subscribe(const std::string &topic,
+                               OfflineCallback offline_callback,
+                               OnlineCallback online_callback) {
   std::lock_guard<std::mutex> lock(mutex_);
-  std::string id = GenerateSubscriptionId();
-  offline_subscribers_[topic][id] = callback;
-  online_subscribers_[topic][id] = callback;
+  uint64_t id = AcquireSubscription();
+  SubscriptionSlot& slot = GetSubscription(id);
+  slot.offline = offline_subscribers_.Add(
+      topic, id, MakeOfflineSubscriber<T>(offline_callback));
+  slot.online = online_subscribers_.Add(topic, id, online_callback);
   return Subscription(id);
 }
 
-}  // namespace farfler::network
\ No newline at end of file
+}  // namespace farfler::network
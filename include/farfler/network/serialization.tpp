@@ -7,36 +7,130 @@ template <typename T>
 struct has_serialize<T, std::void_t<decltype(std::declval<T>().Serialize())>>
     : std::true_type {};
 
+template <typename T, typename = void>
+struct has_encoded_size : std::false_type {};
+
+template <typename T>
+struct has_encoded_size<
+    T, std::void_t<decltype(T::EncodedSize(std::declval<const T&>()))>>
+    : std::true_type {};
+
+template <typename T, typename = void>
+struct has_writer_serialize : std::false_type {};
+
+template <typename T>
+struct has_writer_serialize<
+    T, std::void_t<decltype(T::Serialize(std::declval<const T&>(),
+                                         std::declval<ByteWriter&>()))>>
+    : std::true_type {};
+
 template <typename T, typename = void>
 struct has_deserialize : std::false_type {};
 
 template <typename T>
 struct has_deserialize<T, std::void_t<decltype(T::Deserialize(
-                              std::declval<std::vector<char>&>()))>>
+                              std::declval<ByteReader&>()))>>
+    : std::true_type {};
+
+template <typename T, typename = void>
+struct has_vector_deserialize : std::false_type {};
+
+template <typename T>
+struct has_vector_deserialize<T, std::void_t<decltype(T::Deserialize(
+                                     std::declval<std::vector<char>&>()))>>
     : std::true_type {};
 
+template <typename T>
+constexpr bool kSerializesToVectorOnly =
+    has_serialize<T>::value &&
+    !(has_encoded_size<T>::value && has_writer_serialize<T>::value);
+
+template <typename T>
+std::size_t EncodedSize(const T& message) {
+  if constexpr (has_encoded_size<T>::value &&
+                has_writer_serialize<T>::value) {
+    return T::EncodedSize(message);
+  } else if constexpr (has_serialize<T>::value) {
+    return message.Serialize().size();
+  } else {
+    return sizeof(T);
+  }
+}
+
+template <typename T>
+void Serialize(const T& message, ByteWriter& writer) {
+  if constexpr (has_encoded_size<T>::value &&
+                has_writer_serialize<T>::value) {
+    T::Serialize(message, writer);
+  } else if constexpr (has_serialize<T>::value) {
+    std::vector<char> packet = message.Serialize();
+    writer.Write(packet.data(), packet.size());
+  } else {
+    writer.Write(&message, sizeof(T));
+  }
+}
+
 template <typename T>
 std::vector<char> Serialize(const T& message) {
-  if constexpr (has_serialize<T>::value) {
+  if constexpr (has_serialize<T>::value &&
+                !(has_encoded_size<T>::value &&
+                  has_writer_serialize<T>::value)) {
     return message.Serialize();
   } else {
-    std::vector<char> packet;
-    packet.insert(packet.end(), reinterpret_cast<const char*>(&message),
-                  reinterpret_cast<const char*>(&message) + sizeof(T));
+    std::vector<char> packet(EncodedSize(message));
+    ByteWriter writer(packet);
+    Serialize(message, writer);
     return packet;
   }
 }
 
 template <typename T>
-T Deserialize(std::vector<char>& packet) {
+T Deserialize(ByteReader& reader) {
   if constexpr (has_deserialize<T>::value) {
-    return T::Deserialize(packet);
+    return T::Deserialize(reader);
+  } else if constexpr (has_vector_deserialize<T>::value) {
+    std::vector<char> packet(reader.Data(), reader.Data() + reader.Remaining());
+    T msg = T::Deserialize(packet);
+    reader.Skip(reader.Remaining() - packet.size());
+    return msg;
   } else {
     T msg;
-    memcpy(&msg, packet.data(), sizeof(T));
-    packet.erase(packet.begin(), packet.begin() + sizeof(T));
+    reader.Read(&msg, sizeof(T));
     return msg;
   }
 }
 
-}  // namespace farfler::network
\ No newline at end of file
+template <typename T>
+T Deserialize(std::vector<char>& packet) {
+  ByteReader reader(packet);
+  T msg = Deserialize<T>(reader);
+  packet.erase(packet.begin(), packet.begin() + reader.Position());
+  return msg;
+}
+
+template <typename T>
+EncodedMessage<T>::EncodedMessage(const T& message) : message_(message) {
+  if constexpr (kSerializesToVectorOnly<T>) {
+    packet_ = message.Serialize();
+  }
+}
+
+template <typename T>
+std::size_t EncodedMessage<T>::Size() const {
+  if constexpr (kSerializesToVectorOnly<T>) {
+    return packet_.size();
+  } else {
+    return EncodedSize(message_);
+  }
+}
+
+template <typename T>
+void EncodedMessage<T>::Serialize(ByteWriter& writer) const {
+  if constexpr (kSerializesToVectorOnly<T>) {
+    writer.Write(packet_.data(), packet_.size());
+  } else {
+    network::Serialize(message_, writer);
+  }
+}
+
+}  // namespace farfler::network
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace farfler::network {
+
+// Read cursor over a borrowed byte range. Every read is bounds checked and
+// throws std::out_of_range when the range is exhausted, so a truncated or
+// malformed packet can never read past its end.
+class ByteReader {
+ public:
+  ByteReader(const char* data, std::size_t size);
+  explicit ByteReader(const std::vector<char>& packet);
+
+  const char* Read(std::size_t size);
+  void Read(void* destination, std::size_t size);
+  void Skip(std::size_t size);
+
+  const char* Data() const;
+  std::size_t Position() const;
+  std::size_t Remaining() const;
+  bool Empty() const;
+
+ private:
+  const char* data_;
+  std::size_t size_;
+  std::size_t position_;
+};
+
+// Write cursor over a borrowed, pre-sized byte range. Callers size the range
+// up front from the EncodedSize of what they are about to write, so encoding
+// never reallocates; overrunning the range throws std::out_of_range.
+class ByteWriter {
+ public:
+  ByteWriter(char* data, std::size_t size);
+  explicit ByteWriter(std::vector<char>& packet);
+
+  char* Write(std::size_t size);
+  void Write(const void* source, std::size_t size);
+
+  char* Data() const;
+  std::size_t Position() const;
+  std::size_t Remaining() const;
+  bool Full() const;
+
+ private:
+  char* data_;
+  std::size_t size_;
+  std::size_t position_;
+};
+
+}  // namespace farfler::network
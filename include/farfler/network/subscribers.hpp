@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace farfler::network {
+
+// Per-topic subscriber lists stored as immutable snapshots behind atomically
+// swapped shared_ptrs. Readers never take a lock held across callbacks and may
+// keep iterating a snapshot while writers install a new one, so a callback can
+// subscribe or publish without deadlocking and a slow callback never blocks
+// other publishers. Writers must be serialized by the caller.
+template <typename Subscriber>
+class SubscriberTable {
+ public:
+  using Entries = std::vector<std::pair<uint64_t, Subscriber>>;
+
+  // One topic's subscribers. Add hands out the topic's slot so that Remove
+  // needs no lookup by topic.
+  struct Slot {
+    std::shared_ptr<const Entries> entries;
+  };
+
+  SubscriberTable();
+
+  std::shared_ptr<const Entries> Find(const std::string& topic) const;
+  std::vector<std::string> Topics() const;
+
+  std::shared_ptr<Slot> Add(const std::string& topic, uint64_t id,
+                            Subscriber subscriber);
+  void Remove(const std::shared_ptr<Slot>& slot, uint64_t id);
+
+ private:
+  using Slots = std::unordered_map<std::string, std::shared_ptr<Slot>>;
+
+  std::shared_ptr<Slot> FindSlot(const std::string& topic) const;
+
+  std::shared_ptr<const Slots> slots_;
+};
+
+}  // namespace farfler::network
+
+#include "subscribers.tpp"
@@ -0,0 +1,79 @@
+namespace farfler::network {
+
+template <typename Subscriber>
+SubscriberTable<Subscriber>::SubscriberTable()
+    : slots_(std::make_shared<const Slots>()) {}
+
+template <typename Subscriber>
+std::shared_ptr<typename SubscriberTable<Subscriber>::Slot>
+SubscriberTable<Subscriber>::FindSlot(const std::string &topic) const {
+  std::shared_ptr<const Slots> slots = std::atomic_load(&slots_);
+  auto slot = slots->find(topic);
+  if (slot == slots->end()) {
+    return nullptr;
+  }
+  return slot->second;
+}
+
+template <typename Subscriber>
+std::shared_ptr<const typename SubscriberTable<Subscriber>::Entries>
+SubscriberTable<Subscriber>::Find(const std::string &topic) const {
+  std::shared_ptr<Slot> slot = FindSlot(topic);
+  if (!slot) {
+    return nullptr;
+  }
+  return std::atomic_load(&slot->entries);
+}
+
+template <typename Subscriber>
+std::vector<std::string> SubscriberTable<Subscriber>::Topics() const {
+  std::shared_ptr<const Slots> slots = std::atomic_load(&slots_);
+  std::vector<std::string> topics;
+  for (const auto &[topic, slot] : *slots) {
+    if (!std::atomic_load(&slot->entries)->empty()) {
+      topics.push_back(topic);
+    }
+  }
+  return topics;
+}
+
+// Topics are never removed from the slot map, so adding a subscriber to a
+// known topic only swaps that topic's entry list.
+template <typename Subscriber>
+std::shared_ptr<typename SubscriberTable<Subscriber>::Slot>
+SubscriberTable<Subscriber>::Add(const std::string &topic, uint64_t id,
+                                 Subscriber subscriber) {
+  std::shared_ptr<Slot> slot = FindSlot(topic);
+  if (!slot) {
+    slot = std::make_shared<Slot>();
+    slot->entries = std::make_shared<const Entries>();
+    auto slots = std::make_shared<Slots>(*std::atomic_load(&slots_));
+    slots->emplace(topic, slot);
+    std::atomic_store(&slots_, std::shared_ptr<const Slots>(std::move(slots)));
+  }
+
+  auto entries = std::make_shared<Entries>(*std::atomic_load(&slot->entries));
+  entries->emplace_back(id, std::move(subscriber));
+  std::atomic_store(&slot->entries,
+                    std::shared_ptr<const Entries>(std::move(entries)));
+  return slot;
+}
+
+// Copies the rest of the topic's subscribers into a new snapshot, so it
+// costs time linear in their number.
+template <typename Subscriber>
+void SubscriberTable<Subscriber>::Remove(const std::shared_ptr<Slot> &slot,
+                                         uint64_t id) {
+  std::shared_ptr<const Entries> current = std::atomic_load(&slot->entries);
+  auto entries = std::make_shared<Entries>();
+  entries->reserve(current->size());
+  for (const auto &entry : *current) {
+    if (entry.first != id) {
+      entries->push_back(entry);
+    }
+  }
+  std::atomic_store(&slot->entries,
+                    std::shared_ptr<const Entries>(std::move(entries)));
+}
+
+}  // namespace farfler::network
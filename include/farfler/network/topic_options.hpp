@@ -0,0 +1,85 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <farfler/network/message_info.hpp>
+#include <optional>
+
+namespace farfler::network {
+
+// What happens to a publication that would push a peer's send queue past one
+// of its limits.
+enum class OverflowPolicy : uint8_t {
+  // Wait until the peer has drained enough of its queue. Never use this from
+  // a callback running on an io_context thread that the peer's writes need.
+  kBlock = 0,
+  // Leave the publication out and report kQueueFull.
+  kFailFast = 1,
+  // Make room by dropping the oldest queued publications on the same topic,
+  // falling back to dropping the new one if none are left to drop.
+  kDropOldest = 2,
+  // Leave the publication out and report kDroppedNewest.
+  kDropNewest = 3,
+};
+
+// The outcome of queueing a publication. When it fans out to several peers
+// this is the worst outcome among them.
+enum class PublishStatus : uint8_t {
+  kOk = 0,
+  kDroppedOldest = 1,
+  kDroppedNewest = 2,
+  kQueueFull = 3,
+};
+
+// The lane a topic's publications queue in for each peer. Lanes are written
+// in order of priority, and frames larger than a chunk are sent a chunk at a
+// time, so a bulk transfer never holds up a higher lane for longer than one
+// write. Control frames share kHigh.
+enum class Priority : uint8_t {
+  kHigh = 0,
+  kNormal = 1,
+  kBulk = 2,
+};
+
+// Limits on what may be waiting to be written to one peer. Zero means no
+// limit. Bytes include the frame currently being written.
+struct QueueLimits {
+  std::size_t max_bytes = 0;
+  std::size_t max_messages = 0;
+};
+
+// How long publications may wait in a peer's send queue so that those
+// published close together go out packed into one batch frame. Publications
+// that are not batched are written as soon as the socket is free and take
+// any batched ones queued ahead of them along.
+struct BatchOptions {
+  // How long the first publication of a batch may wait. Zero turns batching
+  // off.
+  std::chrono::microseconds window{0};
+  // Publications waiting on the window are sent once they add up to this.
+  std::size_t max_bytes = 64 * 1024;
+};
+
+struct TopicOptions {
+  // With the default, publications to a peer that falls behind by a whole
+  // queue are dropped even over TCP.
+  OverflowPolicy overflow_policy = OverflowPolicy::kDropOldest;
+  // Per peer, counting only this topic's publications.
+  QueueLimits queue_limits;
+  // Keep only the newest value. A publication that finds an older one still
+  // waiting in a peer's send queue takes its place instead of queueing
+  // behind it, and subscriptions made afterwards on this node skip straight
+  // to the newest message when their dispatch queue falls behind.
+  bool conflate = false;
+  // Overrides the peer's batching for this topic. Latency-critical topics
+  // set a zero window to bypass batching altogether.
+  std::optional<BatchOptions> batching;
+  // Chosen by the publisher. Subscribers join the topic's multicast group
+  // only if the topic is set to kMulticast on their node before they
+  // subscribe, and get multicast publications over TCP otherwise.
+  Transport transport = Transport::kTcp;
+  Priority priority = Priority::kNormal;
+};
+
+}  // namespace farfler::network
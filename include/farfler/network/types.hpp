@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <farfler/network/stream.hpp>
 #include <string>
 #include <vector>
 
@@ -10,10 +11,15 @@ template <typename T>
 class Number {
  public:
   Number(T value = 0);
+  static std::size_t EncodedSize(const T& msg);
   static std::vector<char> Serialize(const T& msg);
-  static std::vector<char> Serialize(const T& msg, std::vector<char>& packet);
+  static std::vector<char>& Serialize(const T& msg,
+                                      std::vector<char>& packet);
+  static void Serialize(const T& msg, ByteWriter& writer);
   static T Deserialize(std::vector<char>& packet);
   static T Deserialize(std::vector<char>& packet, T& msg);
+  static T Deserialize(ByteReader& reader);
+  static T Deserialize(ByteReader& reader, T& msg);
 
   operator T() const;
 
@@ -35,25 +41,52 @@ using Boolean = Number<bool>;
 class String {
  public:
   String(const std::string& value = "");
+  static std::size_t EncodedSize(const std::string& msg);
   static std::vector<char> Serialize(const std::string& msg);
-  static std::vector<char> Serialize(const std::string& msg,
-                                     std::vector<char>& packet);
+  static std::vector<char>& Serialize(const std::string& msg,
+                                      std::vector<char>& packet);
+  static void Serialize(const std::string& msg, ByteWriter& writer);
   static std::string Deserialize(std::vector<char>& packet);
   static std::string Deserialize(std::vector<char>& packet, std::string& msg);
+  static std::string Deserialize(ByteReader& reader);
+  static std::string Deserialize(ByteReader& reader, std::string& msg);
 
   operator std::string() const;
 
   std::string value;
 };
 
+// Unsigned LEB128: seven bits per byte, high bit set on all but the last.
+class VarUInt32 {
+ public:
+  VarUInt32(uint32_t value = 0);
+  static std::size_t EncodedSize(const uint32_t& msg);
+  static std::vector<char> Serialize(const uint32_t& msg);
+  static std::vector<char>& Serialize(const uint32_t& msg,
+                                      std::vector<char>& packet);
+  static void Serialize(const uint32_t& msg, ByteWriter& writer);
+  static uint32_t Deserialize(std::vector<char>& packet);
+  static uint32_t Deserialize(std::vector<char>& packet, uint32_t& msg);
+  static uint32_t Deserialize(ByteReader& reader);
+  static uint32_t Deserialize(ByteReader& reader, uint32_t& msg);
+
+  operator uint32_t() const;
+
+  uint32_t value;
+};
+
 class Vector2 {
  public:
   Vector2(float x = 0, float y = 0);
+  static std::size_t EncodedSize(const Vector2& msg);
   static std::vector<char> Serialize(const Vector2& msg);
-  static std::vector<char> Serialize(const Vector2& msg,
-                                     std::vector<char>& packet);
+  static std::vector<char>& Serialize(const Vector2& msg,
+                                      std::vector<char>& packet);
+  static void Serialize(const Vector2& msg, ByteWriter& writer);
   static Vector2 Deserialize(std::vector<char>& packet);
   static Vector2 Deserialize(std::vector<char>& packet, Vector2& msg);
+  static Vector2 Deserialize(ByteReader& reader);
+  static Vector2 Deserialize(ByteReader& reader, Vector2& msg);
 
   float x, y;
 };
@@ -61,11 +94,15 @@ class Vector2 {
 class Vector3 {
  public:
   Vector3(float x = 0, float y = 0, float z = 0);
+  static std::size_t EncodedSize(const Vector3& msg);
   static std::vector<char> Serialize(const Vector3& msg);
-  static std::vector<char> Serialize(const Vector3& msg,
-                                     std::vector<char>& packet);
+  static std::vector<char>& Serialize(const Vector3& msg,
+                                      std::vector<char>& packet);
+  static void Serialize(const Vector3& msg, ByteWriter& writer);
   static Vector3 Deserialize(std::vector<char>& packet);
   static Vector3 Deserialize(std::vector<char>& packet, Vector3& msg);
+  static Vector3 Deserialize(ByteReader& reader);
+  static Vector3 Deserialize(ByteReader& reader, Vector3& msg);
 
   float x, y, z;
 };
@@ -73,11 +110,15 @@ class Vector3 {
 class Coordinate {
  public:
   Coordinate(double latitude = 0, double longitude = 0);
+  static std::size_t EncodedSize(const Coordinate& msg);
   static std::vector<char> Serialize(const Coordinate& msg);
-  static std::vector<char> Serialize(const Coordinate& msg,
-                                     std::vector<char>& packet);
+  static std::vector<char>& Serialize(const Coordinate& msg,
+                                      std::vector<char>& packet);
+  static void Serialize(const Coordinate& msg, ByteWriter& writer);
   static Coordinate Deserialize(std::vector<char>& packet);
   static Coordinate Deserialize(std::vector<char>& packet, Coordinate& msg);
+  static Coordinate Deserialize(ByteReader& reader);
+  static Coordinate Deserialize(ByteReader& reader, Coordinate& msg);
 
   double latitude, longitude;
 };
@@ -0,0 +1,130 @@
+#include <farfler/network/buffer_pool.hpp>
+#include <utility>
+
+namespace farfler::network {
+
+BufferPool::Buffer::Buffer() : block_(nullptr) {}
+
+BufferPool::Buffer::Buffer(Block* block) : block_(block) {}
+
+BufferPool::Buffer::Buffer(const Buffer& other) : block_(other.block_) {
+  if (block_) {
+    block_->references.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+BufferPool::Buffer::Buffer(Buffer&& other) noexcept : block_(other.block_) {
+  other.block_ = nullptr;
+}
+
+BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer other) noexcept {
+  std::swap(block_, other.block_);
+  return *this;
+}
+
+BufferPool::Buffer::~Buffer() {
+  if (block_) {
+    Unreference(block_);
+  }
+}
+
+std::vector<char>& BufferPool::Buffer::operator*() const {
+  return block_->bytes;
+}
+
+std::vector<char>* BufferPool::Buffer::operator->() const {
+  return &block_->bytes;
+}
+
+BufferPool::Buffer::operator bool() const { return block_ != nullptr; }
+
+BufferPool::Buffer BufferPool::Acquire(std::size_t size) {
+  std::size_t size_class = SizeClass(size);
+  Block* block = nullptr;
+
+  if (size_class != kUnpooled) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    block = free_blocks_[size_class];
+    if (block) {
+      free_blocks_[size_class] = block->next;
+      --free_counts_[size_class];
+    }
+  }
+
+  if (block) {
+    hits_.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    block = new Block();
+    block->size_class = size_class;
+    block->bytes.reserve(size_class == kUnpooled ? size
+                                                 : kMinBlockSize << size_class);
+  }
+
+  block->bytes.resize(size);
+  block->references.store(1, std::memory_order_relaxed);
+  block->pool = shared_from_this();
+  block->next = nullptr;
+  bytes_outstanding_.fetch_add(block->bytes.capacity(),
+                               std::memory_order_relaxed);
+  return Buffer(block);
+}
+
+BufferPool::Stats BufferPool::GetStats() const {
+  return Stats{hits_.load(std::memory_order_relaxed),
+               misses_.load(std::memory_order_relaxed),
+               bytes_outstanding_.load(std::memory_order_relaxed)};
+}
+
+BufferPool::~BufferPool() {
+  for (Block* block : free_blocks_) {
+    while (block) {
+      Block* next = block->next;
+      delete block;
+      block = next;
+    }
+  }
+}
+
+std::size_t BufferPool::SizeClass(std::size_t size) {
+  std::size_t size_class = 0;
+  std::size_t block_size = kMinBlockSize;
+  while (block_size < size) {
+    if (block_size == kMaxBlockSize) {
+      return kUnpooled;
+    }
+    block_size <<= 1;
+    ++size_class;
+  }
+  return size_class;
+}
+
+// The block holds the last reference to its pool while it is handed out, so
+// the pool is kept alive until the block is back on a free list.
+void BufferPool::Unreference(Block* block) {
+  if (block->references.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  std::shared_ptr<BufferPool> pool = std::move(block->pool);
+  pool->Release(block);
+}
+
+void BufferPool::Release(Block* block) {
+  bytes_outstanding_.fetch_sub(block->bytes.capacity(),
+                               std::memory_order_relaxed);
+
+  std::size_t size_class = block->size_class;
+  if (size_class != kUnpooled) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_counts_[size_class] * (kMinBlockSize << size_class) <
+        kMaxFreeBytesPerClass) {
+      block->next = free_blocks_[size_class];
+      free_blocks_[size_class] = block;
+      ++free_counts_[size_class];
+      return;
+    }
+  }
+  delete block;
+}
+
+}  // namespace farfler::network
@@ -0,0 +1,802 @@
+#include <algorithm>
+#include <farfler/network/connection.hpp>
+#include <farfler/network/protocol.hpp>
+#include <farfler/network/types.hpp>
+
+namespace farfler::network {
+
+Connection::Connection(boost::asio::ip::tcp::socket socket,
+                       boost::asio::io_context& io_context,
+                       std::shared_ptr<BufferPool> buffer_pool,
+                       std::size_t max_write_size)
+    : socket_(std::move(socket)),
+      strand_(io_context),
+      buffer_pool_(std::move(buffer_pool)),
+      max_write_size_(max_write_size),
+      queued_bytes_(0),
+      queued_messages_(0),
+      throttled_count_(0),
+      dropped_count_(0),
+      conflated_count_(0),
+      batch_count_(0),
+      batched_count_(0),
+      batch_timer_(io_context),
+      batch_timer_armed_(false),
+      batch_bytes_(0),
+      heartbeat_timer_(io_context),
+      heartbeat_interval_(0),
+      heartbeat_misses_(0),
+      missed_heartbeats_(0),
+      received_since_heartbeat_(false),
+      throttled_(false),
+      throttle_reported_(false),
+      receive_buffer_(buffer_pool_->Acquire(kInitialReceiveBufferSize)),
+      receive_begin_(0),
+      receive_end_(0),
+      receive_needed_(sizeof(uint32_t)),
+      max_message_size_(kDefaultMaxMessageSize),
+      writing_(false),
+      closed_(false) {}
+
+void Connection::Send(Frame frame) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Enqueue(std::move(frame));
+}
+
+// The announcement is queued ahead of the first publication that uses the
+// topic id, so the peer always learns the binding before it needs it.
+PublishStatus Connection::SendPublication(uint32_t topic_id,
+                                          const Frame& announcement,
+                                          Frame frame,
+                                          const TopicOptions& options) {
+  PublishStatus status = PublishStatus::kOk;
+  bool throttle_started = false;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (topic_id >= topic_queues_.size()) {
+      topic_queues_.resize(topic_id + 1);
+    }
+
+    TopicQueue& topic = topic_queues_[topic_id];
+    if (options.conflate && topic.waiting_index != kNotWaiting) {
+      QueuedFrame& waiting =
+          lanes_[topic.waiting_lane].frames[topic.waiting_index];
+      queued_bytes_ += frame->size() - waiting.frame->size();
+      topic.bytes += frame->size() - waiting.frame->size();
+      waiting.frame = std::move(frame);
+      ++conflated_count_;
+      return PublishStatus::kOk;
+    }
+
+    if (OverLimit(topic_id, frame->size(), options.queue_limits)) {
+      ++throttled_count_;
+      throttle_started = !throttled_;
+      throttled_ = true;
+    }
+    while (!closed_ &&
+           OverLimit(topic_id, frame->size(), options.queue_limits)) {
+      if (options.overflow_policy == OverflowPolicy::kBlock) {
+        space_available_.wait(lock);
+        continue;
+      }
+      if (options.overflow_policy == OverflowPolicy::kDropOldest &&
+          DropOldest(topic_id)) {
+        status = PublishStatus::kDroppedOldest;
+        continue;
+      }
+      status = options.overflow_policy == OverflowPolicy::kFailFast
+                   ? PublishStatus::kQueueFull
+                   : PublishStatus::kDroppedNewest;
+      ++dropped_count_;
+      break;
+    }
+
+    if (status != PublishStatus::kQueueFull &&
+        status != PublishStatus::kDroppedNewest) {
+      const BatchOptions& batching =
+          options.batching ? *options.batching : batch_options_;
+      if (!topic_queues_[topic_id].announced) {
+        topic_queues_[topic_id].announced = true;
+        Enqueue(announcement, kNoTopic, batching);
+      }
+      Enqueue(std::move(frame), topic_id, batching, options.priority);
+    }
+  }
+
+  if (throttle_started) {
+    boost::asio::post(strand_, [self = shared_from_this()]() {
+      self->ReportThrottle();
+    });
+  }
+  return status;
+}
+
+void Connection::SetRemoteTopic(uint32_t topic_id, const std::string& topic) {
+  remote_topics_[topic_id] = topic;
+}
+
+const std::string* Connection::RemoteTopic(uint32_t topic_id) const {
+  auto topic = remote_topics_.find(topic_id);
+  if (topic == remote_topics_.end()) {
+    return nullptr;
+  }
+  return &topic->second;
+}
+
+// Must be called with mutex_ held. An idle writer is started straight away
+// unless the frame is batched, in which case it waits for the batch window to
+// close or for enough batched bytes to pile up.
+void Connection::Enqueue(Frame frame, uint32_t topic_id,
+                         const BatchOptions& batching, Priority priority) {
+  if (closed_) {
+    return;
+  }
+  std::size_t size = frame->size();
+  bool batched = batching.window.count() > 0;
+  Lane& lane = lanes_[static_cast<std::size_t>(priority)];
+  queued_bytes_ += size;
+  ++queued_messages_;
+  if (topic_id != kNoTopic) {
+    topic_queues_[topic_id].bytes += size;
+    ++topic_queues_[topic_id].messages;
+    topic_queues_[topic_id].waiting_lane = static_cast<std::size_t>(priority);
+    topic_queues_[topic_id].waiting_index = lane.frames.size();
+  }
+  lane.frames.push_back(QueuedFrame{std::move(frame), topic_id, batched});
+  if (!writing_ && batched) {
+    batch_bytes_ += size;
+    if (batch_bytes_ < batching.max_bytes) {
+      ArmBatchTimer(std::chrono::steady_clock::now() + batching.window);
+      return;
+    }
+  }
+  if (!writing_) {
+    writing_ = true;
+    boost::asio::post(
+        strand_, MakeAllocatingHandler(start_writing_memory_,
+                                       [self = shared_from_this()]() {
+                                         std::lock_guard<std::mutex> lock(
+                                             self->mutex_);
+                                         self->StartWriting();
+                                       }));
+  }
+}
+
+// Must be called with mutex_ held.
+bool Connection::HasQueuedFrames() const {
+  for (const Lane& lane : lanes_) {
+    if (lane.head < lane.frames.size()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Must be called with mutex_ held. Only ever brings the deadline forward;
+// a wait that is cancelled or outlived by a later one does nothing.
+void Connection::ArmBatchTimer(std::chrono::steady_clock::time_point deadline) {
+  if (batch_timer_armed_ && deadline >= batch_deadline_) {
+    return;
+  }
+  batch_timer_armed_ = true;
+  batch_deadline_ = deadline;
+  batch_timer_.expires_at(deadline);
+  batch_timer_.async_wait(boost::asio::bind_executor(
+      strand_,
+      MakeAllocatingHandler(batch_timer_memory_,
+                            [self = shared_from_this()](
+                                const boost::system::error_code& error) {
+                              self->HandleBatchTimer(error);
+                            })));
+}
+
+void Connection::HandleBatchTimer(const boost::system::error_code& error) {
+  if (error == boost::asio::error::operation_aborted) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  batch_timer_armed_ = false;
+  if (!writing_ && !closed_ && HasQueuedFrames()) {
+    writing_ = true;
+    StartWriting();
+  }
+}
+
+// Must be called with mutex_ held. A queue that is empty always has room,
+// so a frame larger than a byte limit still goes out on its own.
+bool Connection::OverLimit(uint32_t topic_id, std::size_t size,
+                           const QueueLimits& topic_limits) const {
+  const TopicQueue& topic = topic_queues_[topic_id];
+  return (queued_messages_ > 0 &&
+          ((queue_limits_.max_bytes &&
+            queued_bytes_ + size > queue_limits_.max_bytes) ||
+           (queue_limits_.max_messages &&
+            queued_messages_ + 1 > queue_limits_.max_messages))) ||
+         (topic.messages > 0 &&
+          ((topic_limits.max_bytes &&
+            topic.bytes + size > topic_limits.max_bytes) ||
+           (topic_limits.max_messages &&
+            topic.messages + 1 > topic_limits.max_messages)));
+}
+
+// Must be called with mutex_ held. Only frames still waiting in the queue can
+// be dropped; the ones being written, even in part, are already in the
+// socket's hands.
+bool Connection::DropOldest(uint32_t topic_id) {
+  for (std::size_t l = 0; l < kLaneCount; ++l) {
+    Lane& lane = lanes_[l];
+    std::size_t first = lane.head + (lane.fragment_offset > 0 ? 1 : 0);
+    for (std::size_t i = first; i < lane.frames.size(); ++i) {
+      if (lane.frames[i].topic_id == topic_id) {
+        Dequeue(lane.frames[i]);
+        lane.frames.erase(lane.frames.begin() + i);
+        EraseWaiting(l, i, 1);
+        ++dropped_count_;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Must be called with mutex_ held.
+void Connection::Dequeue(const QueuedFrame& queued) {
+  queued_bytes_ -= queued.frame->size();
+  --queued_messages_;
+  if (queued.topic_id != kNoTopic) {
+    topic_queues_[queued.topic_id].bytes -= queued.frame->size();
+    --topic_queues_[queued.topic_id].messages;
+  }
+}
+
+// Must be called with mutex_ held. Keeps each topic's waiting_index pointing
+// at the same frame after count entries from first on leave the lane.
+void Connection::EraseWaiting(std::size_t lane, std::size_t first,
+                              std::size_t count) {
+  for (TopicQueue& topic : topic_queues_) {
+    if (topic.waiting_index == kNotWaiting || topic.waiting_lane != lane ||
+        topic.waiting_index < first) {
+      continue;
+    }
+    if (topic.waiting_index < first + count) {
+      topic.waiting_index = kNotWaiting;
+    } else {
+      topic.waiting_index -= count;
+    }
+  }
+}
+
+// Must be called with mutex_ held.
+void Connection::ClearQueue() {
+  for (std::size_t l = 0; l < kLaneCount; ++l) {
+    Lane& lane = lanes_[l];
+    for (std::size_t i = lane.head; i < lane.frames.size(); ++i) {
+      Dequeue(lane.frames[i]);
+    }
+    EraseWaiting(l, 0, lane.frames.size());
+    lane.frames.clear();
+    lane.head = 0;
+    lane.fragment_offset = 0;
+  }
+  space_available_.notify_all();
+}
+
+// Runs on the strand, so changes are reported in order. Reports the current
+// state rather than the change that asked for the report, which skips
+// episodes that were already over by the time the report ran.
+void Connection::ReportThrottle() {
+  bool throttled;
+  ThrottleHandler throttle_handler;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    throttled = throttled_;
+    throttle_handler = throttle_handler_;
+  }
+  if (throttled == throttle_reported_) {
+    return;
+  }
+  throttle_reported_ = throttled;
+  if (throttle_handler) {
+    throttle_handler(shared_from_this(), throttled);
+  }
+}
+
+void Connection::Close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    ClearQueue();
+  }
+  boost::asio::post(strand_, [self = shared_from_this()]() {
+    boost::system::error_code error;
+    self->batch_timer_.cancel(error);
+    self->heartbeat_timer_.cancel(error);
+    self->socket_.close(error);
+  });
+}
+
+void Connection::SetErrorHandler(ErrorHandler handler) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  error_handler_ = std::move(handler);
+}
+
+void Connection::SetFrameHandler(FrameHandler handler) {
+  frame_handler_ = std::move(handler);
+}
+
+void Connection::SetThrottleHandler(ThrottleHandler handler) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  throttle_handler_ = std::move(handler);
+}
+
+void Connection::SetQueueLimits(const QueueLimits& limits) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  queue_limits_ = limits;
+  space_available_.notify_all();
+}
+
+void Connection::SetBatchOptions(const BatchOptions& options) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  batch_options_ = options;
+}
+
+void Connection::SetHeartbeat(std::chrono::milliseconds interval,
+                              unsigned misses) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  heartbeat_interval_ = interval;
+  heartbeat_misses_ = std::max(misses, 1u);
+}
+
+// Runs on the strand.
+void Connection::ArmHeartbeatTimer() {
+  std::chrono::milliseconds interval;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_ || heartbeat_interval_.count() == 0) {
+      return;
+    }
+    interval = heartbeat_interval_;
+  }
+  heartbeat_timer_.expires_after(interval);
+  heartbeat_timer_.async_wait(boost::asio::bind_executor(
+      strand_, MakeAllocatingHandler(
+                   heartbeat_timer_memory_,
+                   [self = shared_from_this()](
+                       const boost::system::error_code& error) {
+                     self->HandleHeartbeatTimer(error);
+                   })));
+}
+
+// Runs on the strand. No heartbeat is sent while a write is in flight; the
+// peer hears from this end when it completes, and if it is stuck a
+// heartbeat queued behind it would not get through either. Heartbeats are
+// written straight away rather than queued, so they never count against
+// the queue limits or show up in the queue stats.
+void Connection::HandleHeartbeatTimer(const boost::system::error_code& error) {
+  if (error) {
+    return;
+  }
+
+  if (received_since_heartbeat_) {
+    missed_heartbeats_ = 0;
+  } else if (++missed_heartbeats_ >= heartbeat_misses_) {
+    Fail(boost::asio::error::timed_out);
+    return;
+  }
+  received_since_heartbeat_ = false;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_) {
+      return;
+    }
+    if (!writing_) {
+      static const std::size_t kHeaderSize =
+          FrameHeader::EncodedSize(FrameHeader(MessageKind::kHeartbeat));
+      Frame frame =
+          buffer_pool_->Acquire(UInt32::EncodedSize(kHeaderSize) + kHeaderSize);
+      ByteWriter writer(*frame);
+      UInt32::Serialize(kHeaderSize, writer);
+      FrameHeader::Serialize(FrameHeader(MessageKind::kHeartbeat), writer);
+      writing_ = true;
+      writing_buffers_.push_back(boost::asio::buffer(*frame));
+      writing_extra_.push_back(std::move(frame));
+      Write();
+    }
+  }
+  ArmHeartbeatTimer();
+}
+
+void Connection::SetMaxMessageSize(std::size_t size) {
+  max_message_size_.store(size, std::memory_order_relaxed);
+}
+
+Connection::QueueStats Connection::GetQueueStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return QueueStats{queued_bytes_, queued_messages_, throttled_count_,
+                    dropped_count_, conflated_count_, batch_count_,
+                    batched_count_};
+}
+
+boost::asio::ip::tcp::socket& Connection::Socket() { return socket_; }
+
+void Connection::StartReceiving() {
+  boost::system::error_code error;
+  socket_.set_option(boost::asio::ip::tcp::no_delay(true), error);
+  boost::asio::post(strand_, [self = shared_from_this()]() {
+    self->ArmHeartbeatTimer();
+    self->Receive();
+  });
+}
+
+// Runs on the strand. Makes sure the next frame fits in the buffer, first by
+// sliding the unparsed bytes to the front and then by trading it for a larger
+// pooled buffer, and reads whatever the socket has available after them.
+void Connection::Receive() {
+  std::vector<char>& buffer = *receive_buffer_;
+  if (receive_begin_ > 0 &&
+      (receive_end_ == buffer.size() ||
+       receive_begin_ + receive_needed_ > buffer.size())) {
+    std::copy(buffer.begin() + receive_begin_, buffer.begin() + receive_end_,
+              buffer.begin());
+    receive_end_ -= receive_begin_;
+    receive_begin_ = 0;
+  }
+  if (receive_needed_ > buffer.size() || receive_end_ == buffer.size()) {
+    BufferPool::Buffer larger =
+        buffer_pool_->Acquire(std::max(receive_needed_, buffer.size() * 2));
+    std::copy(buffer.begin(), buffer.begin() + receive_end_, larger->begin());
+    receive_buffer_ = std::move(larger);
+  }
+
+  socket_.async_read_some(
+      boost::asio::buffer(receive_buffer_->data() + receive_end_,
+                          receive_buffer_->size() - receive_end_),
+      boost::asio::bind_executor(
+          strand_,
+          MakeAllocatingHandler(
+              read_memory_, [self = shared_from_this()](
+                                const boost::system::error_code& error,
+                                std::size_t size) {
+                self->HandleRead(error, size);
+              })));
+}
+
+void Connection::HandleRead(const boost::system::error_code& error,
+                            std::size_t size) {
+  if (error) {
+    Fail(error);
+    return;
+  }
+
+  receive_end_ += size;
+  receive_needed_ = sizeof(uint32_t);
+  received_since_heartbeat_ = true;
+  while (receive_end_ - receive_begin_ >= sizeof(uint32_t)) {
+    ByteReader unparsed(receive_buffer_->data() + receive_begin_,
+                        receive_end_ - receive_begin_);
+    uint32_t packet_size = UInt32::Deserialize(unparsed);
+    if (packet_size > max_message_size_.load(std::memory_order_relaxed)) {
+      Fail(boost::asio::error::message_size);
+      return;
+    }
+    if (unparsed.Remaining() < packet_size) {
+      receive_needed_ = unparsed.Position() + packet_size;
+      break;
+    }
+
+    ByteReader reader(unparsed.Read(packet_size), packet_size);
+    receive_begin_ += unparsed.Position();
+    if (!Reassemble(reader)) {
+      return;
+    }
+  }
+
+  if (receive_begin_ == receive_end_) {
+    receive_begin_ = 0;
+    receive_end_ = 0;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_) {
+      return;
+    }
+  }
+  Receive();
+}
+
+// Runs on the strand. Hands a frame to the frame handler, putting fragments
+// back together first in a buffer sized for the whole frame by its first
+// chunk; heartbeats have done their job by arriving. Returns false if the
+// connection has failed.
+bool Connection::Reassemble(ByteReader& reader) {
+  ByteReader fragment = reader;
+  FrameHeader header;
+  if (fragment.Remaining() >= FrameHeader::EncodedSize(header)) {
+    FrameHeader::Deserialize(fragment, header);
+  }
+  if (header.magic_ == kProtocolMagic &&
+      header.version_ == kProtocolVersion &&
+      header.kind_ == MessageKind::kHeartbeat) {
+    return true;
+  }
+  if (header.magic_ != kProtocolMagic || header.version_ != kProtocolVersion ||
+      header.kind_ != MessageKind::kFragment) {
+    if (frame_handler_) {
+      frame_handler_(shared_from_this(), reader);
+    }
+    return true;
+  }
+
+  BufferPool::Buffer frame;
+  std::size_t frame_size = 0;
+  try {
+    uint32_t lane = VarUInt32::Deserialize(fragment);
+    uint32_t size = UInt32::Deserialize(fragment);
+    if (lane >= kLaneCount) {
+      throw std::out_of_range("Fragment lane out of range");
+    }
+
+    Reassembly& reassembly = reassemblies_[lane];
+    if (!reassembly.buffer) {
+      if (size > max_message_size_.load(std::memory_order_relaxed)) {
+        Fail(boost::asio::error::message_size);
+        return false;
+      }
+      reassembly.buffer = buffer_pool_->Acquire(size);
+      reassembly.size = size;
+      reassembly.filled = 0;
+    }
+    if (size != reassembly.size ||
+        fragment.Remaining() > reassembly.size - reassembly.filled) {
+      throw std::out_of_range("Fragment overruns its frame");
+    }
+
+    std::size_t chunk_size = fragment.Remaining();
+    fragment.Read(reassembly.buffer->data() + reassembly.filled, chunk_size);
+    reassembly.filled += chunk_size;
+    if (reassembly.filled < reassembly.size) {
+      return true;
+    }
+    frame = std::move(reassembly.buffer);
+    frame_size = reassembly.size;
+    reassembly = Reassembly();
+  } catch (const std::out_of_range&) {
+    Fail(boost::system::errc::make_error_code(
+        boost::system::errc::protocol_error));
+    return false;
+  }
+
+  if (frame_handler_) {
+    ByteReader whole(frame->data(), frame_size);
+    frame_handler_(shared_from_this(), whole);
+  }
+  return true;
+}
+
+// Runs on the strand with mutex_ held. Writes go through the strand so they
+// never race the read loop on the same socket. Fills one write of about
+// max_write_size_ from the lanes in order of priority. The first frame or
+// chunk always goes in, so there is never an empty write while frames wait.
+void Connection::StartWriting() {
+  batch_bytes_ = 0;
+  std::size_t size = 0;
+  for (std::size_t l = 0; l < kLaneCount && size < max_write_size_; ++l) {
+    Lane& lane = lanes_[l];
+    while (lane.head < lane.frames.size() && size < max_write_size_) {
+      std::size_t batch_size = TakeBatch(l, max_write_size_ - size);
+      if (batch_size > 0) {
+        size += batch_size;
+        continue;
+      }
+
+      std::size_t frame_size = lane.frames[lane.head].frame->size();
+      if (frame_size > kFragmentSize) {
+        size += TakeFragment(l);
+        continue;
+      }
+      if (size > 0 && size + frame_size > max_write_size_) {
+        break;
+      }
+      writing_buffers_.push_back(
+          boost::asio::buffer(*lane.frames[lane.head].frame));
+      TakeHead(l);
+      size += frame_size;
+    }
+
+    if (lane.head == lane.frames.size()) {
+      lane.frames.clear();
+      lane.head = 0;
+    } else if (lane.head * 2 >= lane.frames.size()) {
+      lane.frames.erase(lane.frames.begin(),
+                        lane.frames.begin() + lane.head);
+      EraseWaiting(l, 0, lane.head);
+      lane.head = 0;
+    }
+  }
+
+  if (writing_buffers_.empty()) {
+    writing_ = false;
+    return;
+  }
+  Write();
+}
+
+// Runs on the strand with mutex_ held. Writes writing_buffers_.
+void Connection::Write() {
+  boost::asio::async_write(
+      socket_, WritingBuffers{&writing_buffers_},
+      boost::asio::bind_executor(
+          strand_,
+          MakeAllocatingHandler(
+              write_memory_, [self = shared_from_this()](
+                                 const boost::system::error_code& error,
+                                 std::size_t) {
+                self->HandleWrite(error);
+              })));
+}
+
+// Runs on the strand with mutex_ held. Once a frame has been picked up for
+// writing, a newer publication on a conflated topic can no longer take its
+// place.
+void Connection::StopWaiting(std::size_t l) {
+  const Lane& lane = lanes_[l];
+  uint32_t topic_id = lane.frames[lane.head].topic_id;
+  if (topic_id != kNoTopic && topic_queues_[topic_id].waiting_lane == l &&
+      topic_queues_[topic_id].waiting_index == lane.head) {
+    topic_queues_[topic_id].waiting_index = kNotWaiting;
+  }
+}
+
+// Runs on the strand with mutex_ held. Moves the frame at the head of the
+// lane into writing_frames_, where it stays accounted for until written.
+void Connection::TakeHead(std::size_t l) {
+  Lane& lane = lanes_[l];
+  StopWaiting(l);
+  writing_frames_.push_back(std::move(lane.frames[lane.head]));
+  ++lane.head;
+  lane.fragment_offset = 0;
+}
+
+// Runs on the strand with mutex_ held. Packs the run of batched publications
+// at the head of the lane into one batch frame of at most limit bytes,
+// dropping each publication's own length prefix and header. Returns the
+// size of the batch frame, or zero if fewer than two publications fit.
+// Frames large enough to be fragmented end the run.
+std::size_t Connection::TakeBatch(std::size_t l, std::size_t limit) {
+  static const std::size_t kHeaderSize =
+      FrameHeader::EncodedSize(FrameHeader(MessageKind::kBatch));
+  static const std::size_t kPrefixSize = UInt32::EncodedSize(0) + kHeaderSize;
+
+  Lane& lane = lanes_[l];
+  if (lane.fragment_offset > 0) {
+    return 0;
+  }
+  std::size_t packet_size = kHeaderSize;
+  std::size_t end = lane.head;
+  while (end < lane.frames.size() && lane.frames[end].batched &&
+         lane.frames[end].topic_id != kNoTopic &&
+         lane.frames[end].frame->size() <= kFragmentSize) {
+    uint32_t body_size = lane.frames[end].frame->size() - kPrefixSize;
+    std::size_t entry_size = VarUInt32::EncodedSize(body_size) + body_size;
+    if (UInt32::EncodedSize(0) + packet_size + entry_size > limit) {
+      break;
+    }
+    packet_size += entry_size;
+    ++end;
+  }
+  if (end - lane.head < 2) {
+    return 0;
+  }
+
+  Frame batch =
+      buffer_pool_->Acquire(UInt32::EncodedSize(packet_size) + packet_size);
+  ByteWriter writer(*batch);
+  UInt32::Serialize(packet_size, writer);
+  FrameHeader::Serialize(FrameHeader(MessageKind::kBatch), writer);
+  batched_count_ += end - lane.head;
+  ++batch_count_;
+  while (lane.head < end) {
+    const std::vector<char>& frame = *lane.frames[lane.head].frame;
+    uint32_t body_size = frame.size() - kPrefixSize;
+    VarUInt32::Serialize(body_size, writer);
+    writer.Write(frame.data() + kPrefixSize, body_size);
+    TakeHead(l);
+  }
+  writing_buffers_.push_back(boost::asio::buffer(*batch));
+  std::size_t batch_size = batch->size();
+  writing_extra_.push_back(std::move(batch));
+  return batch_size;
+}
+
+// Runs on the strand with mutex_ held. Adds the next chunk of the frame at
+// the head of the lane to the write behind a fragment header of its own; the
+// chunk is written straight from the frame. The frame stays at the head of
+// the lane until its last chunk is taken. Returns the bytes added.
+std::size_t Connection::TakeFragment(std::size_t l) {
+  static const std::size_t kHeaderSize =
+      FrameHeader::EncodedSize(FrameHeader(MessageKind::kFragment));
+
+  Lane& lane = lanes_[l];
+  const Frame& frame = lane.frames[lane.head].frame;
+  if (lane.fragment_offset == 0) {
+    StopWaiting(l);
+    lane.fragment_offset = UInt32::EncodedSize(0);
+  }
+  uint32_t body_size = frame->size() - UInt32::EncodedSize(0);
+  std::size_t chunk_size =
+      std::min(kFragmentSize, frame->size() - lane.fragment_offset);
+  uint32_t packet_size = kHeaderSize + VarUInt32::EncodedSize(l) +
+                         UInt32::EncodedSize(body_size) + chunk_size;
+
+  Frame header = buffer_pool_->Acquire(UInt32::EncodedSize(packet_size) +
+                                       packet_size - chunk_size);
+  ByteWriter writer(*header);
+  UInt32::Serialize(packet_size, writer);
+  FrameHeader::Serialize(FrameHeader(MessageKind::kFragment), writer);
+  VarUInt32::Serialize(l, writer);
+  UInt32::Serialize(body_size, writer);
+  writing_buffers_.push_back(boost::asio::buffer(*header));
+  writing_buffers_.push_back(
+      boost::asio::buffer(frame->data() + lane.fragment_offset, chunk_size));
+  writing_extra_.push_back(std::move(header));
+
+  lane.fragment_offset += chunk_size;
+  if (lane.fragment_offset == frame->size()) {
+    TakeHead(l);
+  } else {
+    writing_extra_.push_back(frame);
+  }
+  return UInt32::EncodedSize(packet_size) + packet_size;
+}
+
+void Connection::HandleWrite(const boost::system::error_code& error) {
+  bool throttle_ended = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const QueuedFrame& queued : writing_frames_) {
+      Dequeue(queued);
+    }
+    writing_frames_.clear();
+    writing_buffers_.clear();
+    writing_extra_.clear();
+    space_available_.notify_all();
+    if (!error && !closed_) {
+      StartWriting();
+    } else {
+      writing_ = false;
+    }
+    if (!writing_ && throttled_) {
+      throttled_ = false;
+      throttle_ended = true;
+    }
+  }
+
+  if (error) {
+    Fail(error);
+  } else if (throttle_ended) {
+    ReportThrottle();
+  }
+}
+
+// Reports the first read or write error to the error handler and stops all
+// further sends; errors after that are the fallout of closing.
+void Connection::Fail(const boost::system::error_code& error) {
+  ErrorHandler error_handler;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_) {
+      return;
+    }
+    closed_ = true;
+    ClearQueue();
+    error_handler = error_handler_;
+  }
+
+  if (error_handler) {
+    error_handler(shared_from_this(), error);
+  }
+}
+
+}  // namespace farfler::network
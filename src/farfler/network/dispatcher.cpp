@@ -0,0 +1,55 @@
+#include <farfler/network/dispatcher.hpp>
+
+namespace farfler::network {
+
+DispatchQueue::DispatchQueue(boost::asio::any_io_executor executor,
+                             bool conflate)
+    : strand_(std::move(executor)),
+      depth_(0),
+      stopped_(false),
+      conflate_(conflate) {}
+
+std::size_t DispatchQueue::Depth() const {
+  return depth_.load(std::memory_order_relaxed);
+}
+
+void DispatchQueue::Stop() { stopped_.store(true, std::memory_order_release); }
+
+// Takes the waiting task before running it, so whatever is posted while it
+// runs is queued behind it rather than folded into it.
+void DispatchQueue::RunLatest() {
+  std::function<void()> task;
+  {
+    std::lock_guard<std::mutex> lock(latest_mutex_);
+    task.swap(latest_);
+  }
+  depth_.fetch_sub(1, std::memory_order_relaxed);
+  if (task && !stopped_.load(std::memory_order_acquire)) {
+    task();
+  }
+}
+
+Dispatcher::Dispatcher() {}
+
+Dispatcher::Dispatcher(std::size_t threads)
+    : pool_(std::make_unique<boost::asio::thread_pool>(threads)),
+      executor_(pool_->get_executor()) {}
+
+Dispatcher::Dispatcher(boost::asio::any_io_executor executor)
+    : executor_(std::move(executor)) {}
+
+// Lets the pool finish whatever is already queued before its threads exit.
+Dispatcher::~Dispatcher() {
+  if (pool_) {
+    pool_->join();
+  }
+}
+
+std::shared_ptr<DispatchQueue> Dispatcher::MakeQueue(bool conflate) const {
+  if (!executor_) {
+    return nullptr;
+  }
+  return std::make_shared<DispatchQueue>(executor_, conflate);
+}
+
+}  // namespace farfler::network
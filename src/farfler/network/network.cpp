@@ -1,93 +1,191 @@
-#include <boost/uuid/uuid.hpp>
-#include <boost/uuid/uuid_generators.hpp>
-#include <boost/uuid/uuid_io.hpp>
+#include <algorithm>
+#include <cstdlib>
 #include <farfler/network/network.hpp>
+#include <iomanip>
 #include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
 
 namespace farfler::network {
 
+// 128 random bits as 32 hex digits. The engine is seeded from the entropy
+// source once per thread rather than on every call.
 std::string GenerateId() {
-  boost::uuids::random_generator generator;
-  boost::uuids::uuid uuid = generator();
-  return boost::uuids::to_string(uuid);
+  thread_local std::mt19937_64 generator = [] {
+    std::random_device device;
+    std::seed_seq seed{device(), device(), device(), device()};
+    return std::mt19937_64(seed);
+  }();
+  std::ostringstream id;
+  id << std::hex << std::setfill('0') << std::setw(16) << generator()
+     << std::setw(16) << generator();
+  return id.str();
 }
 
 Network::Network(boost::asio::io_context& io_context, const std::string& name)
+    : Network(io_context, [&] {
+        NetworkConfig config;
+        config.name = name;
+        return config;
+      }()) {}
+
+Network::Network(boost::asio::io_context& io_context, const std::string& name,
+                 std::shared_ptr<Dispatcher> dispatcher)
+    : Network(io_context, [&] {
+        NetworkConfig config;
+        config.name = name;
+        config.dispatcher = std::move(dispatcher);
+        return config;
+      }()) {}
+
+Network::Network(boost::asio::io_context& io_context,
+                 const NetworkConfig& config)
     : io_context_(io_context),
-      name_(name),
+      config_(config),
       udp_socket_(io_context),
       tcp_acceptor_(io_context),
+      multicast_socket_(io_context),
+      unicast_socket_(io_context),
+      datagram_send_socket_(io_context),
       cycle_discovery_messages_timer_(io_context),
+      discovery_interval_(config.discovery_interval),
+      peer_set_changed_(false),
+      peer_queue_limits_{Connection::kDefaultMaxQueuedBytes,
+                         Connection::kDefaultMaxQueuedMessages},
+      max_message_size_(Connection::kDefaultMaxMessageSize),
+      redial_jitter_(std::random_device()()),
+      topic_routes_(std::make_shared<const TopicRoutes>()),
+      unicast_routes_(std::make_shared<const UnicastRoutes>()),
+      multicast_routes_(std::make_shared<const MulticastRoutes>()),
+      multicast_buffer_(kMaxDatagramSize),
+      unicast_buffer_(kMaxDatagramSize),
+      joined_multicast_topics_(
+          std::make_shared<const std::vector<std::string>>()),
       id_(GenerateId()),
+      name_(config.name),
+      dispatcher_(config.dispatcher ? config.dispatcher
+                                    : std::make_shared<Dispatcher>()),
       pubsub_(),
-      strand_(io_context) {
+      buffer_pool_(std::make_shared<BufferPool>()),
+      discovery_strand_(io_context),
+      datagram_strand_(io_context) {
   if (!instance) {
-    instance = std::unique_ptr<Network>(new Network(io_context_, name_, true));
+    instance = std::unique_ptr<Network>(
+        new Network(io_context_, config_, true));
     return;
   }
 
-  InitializeUdpSocket();
   InitializeTcpAcceptor();
-  StartReceivingUdpMessages();
+  InitializeDatagramSockets();
+  StartReceivingDatagrams(unicast_socket_, unicast_buffer_, Transport::kUdp);
   StartAcceptingTcpConnections();
-  StartCyclingDiscoveryMessages();
+  DialStaticPeers();
+  if (config_.discovery) {
+    InitializeUdpSocket();
+    StartReceivingUdpMessages();
+    StartCyclingDiscoveryMessages();
+  }
 }
 
 void Network::InitializeUdpSocket() {
   udp_socket_.open(boost::asio::ip::udp::v4());
   udp_socket_.set_option(boost::asio::socket_base::broadcast(true));
   udp_socket_.set_option(boost::asio::ip::udp::socket::reuse_address(true));
-  udp_socket_.bind(
-      boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), 21075));
+  udp_socket_.bind(boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(),
+                                                  config_.discovery_port));
+  udp_local_endpoint_ = udp_socket_.local_endpoint();
 
   std::cout << "UDP listening on: "
-            << udp_socket_.local_endpoint().address().to_string() << ":"
-            << udp_socket_.local_endpoint().port() << std::endl;
+            << udp_local_endpoint_.address().to_string() << ":"
+            << udp_local_endpoint_.port() << std::endl;
 }
 
 void Network::InitializeTcpAcceptor() {
-  tcp_acceptor_.open(boost::asio::ip::tcp::v4());
+  boost::asio::ip::tcp::endpoint endpoint(
+      boost::asio::ip::make_address(config_.bind_address), config_.tcp_port);
+  tcp_acceptor_.open(endpoint.protocol());
   tcp_acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
-  tcp_acceptor_.bind(
-      boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), 0));
+  tcp_acceptor_.bind(endpoint);
   tcp_acceptor_.listen();
+  tcp_local_endpoint_ = tcp_acceptor_.local_endpoint();
 
   std::cout << "TCP listening on: "
-            << tcp_acceptor_.local_endpoint().address().to_string() << ":"
-            << tcp_acceptor_.local_endpoint().port() << std::endl
+            << tcp_local_endpoint_.address().to_string() << ":"
+            << tcp_local_endpoint_.port() << std::endl
             << std::endl;
 }
 
+// One socket, opened with the first multicast subscription, receives every
+// multicast group this node joins and another, on a port announced in the
+// TCP handshake, receives unicast datagrams from all peers. Both kinds are
+// sent through a third, non-blocking socket, so a full send buffer drops the
+// datagram instead of stalling the publisher.
+void Network::InitializeDatagramSockets() {
+  boost::asio::ip::udp::endpoint endpoint(
+      boost::asio::ip::make_address(config_.bind_address), config_.data_port);
+  unicast_socket_.open(endpoint.protocol());
+  unicast_socket_.bind(endpoint);
+  unicast_local_endpoint_ = unicast_socket_.local_endpoint();
+
+  datagram_send_socket_.open(boost::asio::ip::udp::v4());
+  datagram_send_socket_.set_option(boost::asio::ip::multicast::hops(1));
+  datagram_send_socket_.set_option(
+      boost::asio::ip::multicast::enable_loopback(true));
+  datagram_send_socket_.non_blocking(true);
+
+  std::cout << "UDP data channel on: "
+            << unicast_local_endpoint_.address().to_string() << ":"
+            << unicast_local_endpoint_.port() << std::endl;
+}
+
 void Network::StartReceivingUdpMessages() {
   udp_socket_.async_receive_from(
       boost::asio::buffer(recv_buffer_), udp_endpoint_,
       boost::asio::bind_executor(
-          strand_,
+          discovery_strand_,
           [this](const boost::system::error_code& error, std::size_t size) {
             if (error) {
               std::cerr << "Error in UDP receive: " << error.message()
                         << std::endl;
             } else {
-              std::vector<char> packet(recv_buffer_.begin(),
-                                       recv_buffer_.begin() + size);
-              ProcessUdpMessage(packet);
+              ByteReader reader(recv_buffer_.data(), size);
+              ProcessUdpMessage(reader);
             }
             StartReceivingUdpMessages();
           }));
 }
 
+void Network::StartReceivingDatagrams(boost::asio::ip::udp::socket& socket,
+                                      std::vector<char>& buffer,
+                                      Transport transport) {
+  socket.async_receive(
+      boost::asio::buffer(buffer),
+      boost::asio::bind_executor(
+          datagram_strand_, [this, &socket, &buffer, transport](
+                                const boost::system::error_code& error,
+                                std::size_t size) {
+            if (error) {
+              std::cerr << "Error in datagram receive: " << error.message()
+                        << std::endl;
+            } else {
+              ByteReader reader(buffer.data(), size);
+              ProcessDatagram(reader, transport);
+            }
+            StartReceivingDatagrams(socket, buffer, transport);
+          }));
+}
+
 void Network::StartAcceptingTcpConnections() {
   tcp_acceptor_.async_accept(boost::asio::bind_executor(
-      strand_, [this](const boost::system::error_code& error,
-                      boost::asio::ip::tcp::socket socket) {
+      discovery_strand_, [this](const boost::system::error_code& error,
+                                boost::asio::ip::tcp::socket socket) {
         if (!error) {
           std::cout << "Accepted connection from "
                     << socket.remote_endpoint().address().to_string() << ":"
                     << socket.remote_endpoint().port() << std::endl;
 
-          auto shared_socket =
-              std::make_shared<boost::asio::ip::tcp::socket>(std::move(socket));
-          StartReceivingTcpMessages(shared_socket);
+          MakeConnection(std::move(socket))->StartReceiving();
         } else {
           std::cerr << "Error accepting TCP connection: " << error.message()
                     << std::endl;
@@ -100,15 +198,26 @@ void Network::StartCyclingDiscoveryMessages() {
   UdpPing ping;
   ping.id_ = id_;
   ping.name_ = name_;
-  ping.udp_address_ = udp_socket_.local_endpoint().address().to_string();
-  ping.udp_port_ = udp_socket_.local_endpoint().port();
-  ping.tcp_address_ = tcp_acceptor_.local_endpoint().address().to_string();
-  ping.tcp_port_ = tcp_acceptor_.local_endpoint().port();
-  UdpBroadcast(UdpPing::Serialize(ping));
+  ping.udp_address_ = udp_local_endpoint_.address().to_string();
+  ping.udp_port_ = unicast_local_endpoint_.port();
+  ping.tcp_address_ = tcp_local_endpoint_.address().to_string();
+  ping.tcp_port_ = tcp_local_endpoint_.port();
+  UdpBroadcast(EncodeDatagram(MessageKind::kUdpPing, ping));
 
-  cycle_discovery_messages_timer_.expires_after(std::chrono::seconds(1));
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    if (peer_set_changed_) {
+      discovery_interval_ = config_.discovery_interval;
+    } else {
+      discovery_interval_ =
+          std::min(discovery_interval_ * 2, config_.max_discovery_interval);
+    }
+    peer_set_changed_ = false;
+  }
+
+  cycle_discovery_messages_timer_.expires_after(discovery_interval_);
   cycle_discovery_messages_timer_.async_wait(boost::asio::bind_executor(
-      strand_, [this](const boost::system::error_code& error) {
+      discovery_strand_, [this](const boost::system::error_code& error) {
         if (!error) {
           StartCyclingDiscoveryMessages();
         } else {
@@ -118,289 +227,1048 @@ void Network::StartCyclingDiscoveryMessages() {
       }));
 }
 
-void Network::UdpBroadcast(const std::vector<char>& packet) {
+// Static peers are dialed before their ids are known, so their dials are
+// filed under their addresses until the TcpPong names them.
+void Network::DialStaticPeers() {
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  for (const std::string& peer : config_.static_peers) {
+    std::size_t colon = peer.rfind(':');
+    unsigned long port = colon == std::string::npos
+                             ? 0
+                             : std::strtoul(peer.c_str() + colon + 1,
+                                            nullptr, 10);
+    if (port == 0 || port > UINT16_MAX) {
+      std::cerr << "Ignoring static peer without a valid port: " << peer
+                << std::endl;
+      continue;
+    }
+
+    std::string host = peer.substr(0, colon);
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+      host = host.substr(1, host.size() - 2);
+    }
+    peer_set_changed_ = true;
+    ConnectToPeer(
+        DialTarget{peer, host, static_cast<uint16_t>(port), true, ""});
+  }
+}
+
+void Network::UdpBroadcast(Frame packet) {
   boost::asio::ip::address_v4 address =
       boost::asio::ip::address_v4::broadcast();
-  boost::asio::ip::udp::endpoint endpoint =
-      boost::asio::ip::udp::endpoint(address, 21075);
+  UdpSend(std::move(packet),
+          boost::asio::ip::udp::endpoint(address, config_.discovery_port));
+}
+
+void Network::UdpSend(Frame packet,
+                      const boost::asio::ip::udp::endpoint& endpoint) {
+  auto buffer = boost::asio::buffer(*packet);
   udp_socket_.async_send_to(
-      boost::asio::buffer(packet), endpoint,
+      buffer, endpoint,
       boost::asio::bind_executor(
-          strand_,
-          [this](const boost::system::error_code& error, std::size_t size) {
+          discovery_strand_, [this, packet = std::move(packet)](
+                                 const boost::system::error_code& error,
+                                 std::size_t) {
             if (error) {
-              std::cerr << "Error in UDP broadcast: " << error.message()
+              std::cerr << "Error in UDP send: " << error.message()
                         << std::endl;
             }
           }));
 }
 
-void Network::ProcessUdpMessage(const std::vector<char>& packet) {
-  std::vector<char> mutable_packet(packet.begin(), packet.end());
-  std::string type = String::Deserialize(mutable_packet);
+void Network::ProcessUdpMessage(ByteReader& reader) {
+  try {
+    ByteReader packet = reader;
+    FrameHeader header = FrameHeader::DeserializeDatagram(reader);
+    if (!CheckFrameHeader(header, packet, "UDP")) {
+      return;
+    }
 
-  if (type == "udp_ping") {
-    HandleUdpPing(mutable_packet);
-  } else if (type == "udp_pong") {
-    HandleUdpPong(mutable_packet);
+    UdpHandler handler = udp_handlers_[static_cast<uint8_t>(header.kind_)];
+    if (handler) {
+      (this->*handler)(reader);
+    }
+  } catch (const std::out_of_range& error) {
+    std::cerr << "Malformed UDP message: " << error.what() << std::endl;
   }
 }
 
-void Network::HandleUdpPing(std::vector<char>& packet) {
-  UdpPing msg = UdpPing::Deserialize(packet);
+// The multicast socket also sees groups joined by other sockets on the
+// host and topics that share a group, so datagrams for topics this node has
+// not joined are ignored.
+// Datagrams from each publisher on each topic are delivered in sequence
+// order; one that arrives after a later one is dropped. Unicast datagrams
+// from peers that have not completed the handshake are delivered but not
+// counted.
+void Network::ProcessDatagram(ByteReader& reader, Transport transport) {
+  try {
+    ByteReader packet = reader;
+    FrameHeader header = FrameHeader::DeserializeDatagram(reader);
+    if (!CheckFrameHeader(header, packet, "datagram")) {
+      return;
+    }
+    if (header.kind_ == MessageKind::kUdpPong &&
+        transport == Transport::kUdp) {
+      HandleUdpPong(reader);
+      return;
+    }
+    if (header.kind_ != MessageKind::kDatagramPublication) {
+      return;
+    }
 
-  if (msg.id_ != id_) {
-    UdpPong pong_msg;
-    pong_msg.id_ = id_;
-    pong_msg.name_ = name_;
-    pong_msg.udp_address_ = udp_socket_.local_endpoint().address().to_string();
-    pong_msg.udp_port_ = udp_socket_.local_endpoint().port();
-    pong_msg.tcp_address_ =
-        tcp_acceptor_.local_endpoint().address().to_string();
-    pong_msg.tcp_port_ = tcp_acceptor_.local_endpoint().port();
-    UdpBroadcast(UdpPong::Serialize(pong_msg));
+    std::string publisher = String::Deserialize(reader);
+    std::string topic = String::Deserialize(reader);
+    uint64_t sequence = UInt64::Deserialize(reader);
+    std::chrono::microseconds sent_at(Int64::Deserialize(reader));
+    if (publisher == id_) {
+      return;
+    }
+
+    DatagramCounters* counters = &multicast_counters_;
+    std::shared_ptr<UdpPeer> peer;
+    if (transport == Transport::kMulticast) {
+      std::lock_guard<std::mutex> lock(pubsub_mutex_);
+      if (multicast_topic_members_.find(topic) ==
+          multicast_topic_members_.end()) {
+        return;
+      }
+    } else {
+      std::lock_guard<std::mutex> lock(connections_mutex_);
+      auto udp_peer = udp_peers_.find(publisher);
+      if (udp_peer != udp_peers_.end()) {
+        peer = udp_peer->second;
+      }
+      counters = peer ? &peer->counters : nullptr;
+    }
+
+    std::string key = publisher;
+    key += transport == Transport::kMulticast ? "/m/" : "/u/";
+    key += topic;
+    auto next = datagram_next_sequence_.try_emplace(key, sequence).first;
+    if (sequence < next->second) {
+      if (counters) {
+        ++counters->late;
+      }
+      return;
+    }
+    if (counters) {
+      ++counters->received;
+      counters->lost += sequence - next->second;
+    }
+    next->second = sequence + 1;
+
+    pubsub_.PublishOnline(
+        topic, reader,
+        MessageInfo{transport, sequence,
+                    std::chrono::system_clock::time_point(sent_at)});
+  } catch (const std::out_of_range& error) {
+    std::cerr << "Malformed datagram: " << error.what() << std::endl;
   }
 }
 
-void Network::HandleUdpPong(std::vector<char>& packet) {
-  UdpPong msg = UdpPong::Deserialize(packet);
+// Pings are broadcast, but only peers this node is not already connected
+// or connecting to get an answer, and the pong goes straight back to the
+// pinging node's own UDP port instead of to every node on the segment.
+// Pings advertise that port as udp_port_.
+void Network::HandleUdpPing(ByteReader& reader) {
+  UdpPing msg = UdpPing::Deserialize(reader);
 
-  if (msg.id_ != id_) {
-    std::lock_guard<std::mutex> lock(tcp_sockets_mutex_);
-    if (unverified_tcp_sockets_.find(msg.id_) ==
-            unverified_tcp_sockets_.end() &&
-        connecting_tcp_sockets_.find(msg.id_) ==
-            connecting_tcp_sockets_.end()) {
-      ConnectToPeer(msg);
+  if (msg.id_ == id_) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    if (unverified_connections_.find(msg.id_) !=
+            unverified_connections_.end() ||
+        connections_.find(msg.id_) != connections_.end()) {
+      return;
     }
   }
+
+  UdpPong pong_msg;
+  pong_msg.id_ = id_;
+  pong_msg.name_ = name_;
+  pong_msg.udp_address_ = udp_local_endpoint_.address().to_string();
+  pong_msg.udp_port_ = unicast_local_endpoint_.port();
+  pong_msg.tcp_address_ = tcp_local_endpoint_.address().to_string();
+  pong_msg.tcp_port_ = tcp_local_endpoint_.port();
+  UdpSend(EncodeDatagram(MessageKind::kUdpPong, pong_msg),
+          boost::asio::ip::udp::endpoint(udp_endpoint_.address(),
+                                         msg.udp_port_));
+  DiscoverPeer(msg.id_, msg.tcp_address_, msg.tcp_port_);
+}
+
+// Pongs arrive on the unicast data socket.
+void Network::HandleUdpPong(ByteReader& reader) {
+  UdpPong msg = UdpPong::Deserialize(reader);
+
+  if (msg.id_ != id_) {
+    DiscoverPeer(msg.id_, msg.tcp_address_, msg.tcp_port_);
+  }
+}
+
+// Dials a peer this node is neither connected nor connecting to, if this
+// node has the lower id; the other peer waits to be dialed. A node that
+// hears a ping dials back right away, so peers it has not met yet do not
+// wait for its own discovery interval, which may have backed off.
+void Network::DiscoverPeer(const std::string& id,
+                           const std::string& tcp_address,
+                           uint16_t tcp_port) {
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  if (id_ < id &&
+      unverified_connections_.find(id) == unverified_connections_.end() &&
+      connections_.find(id) == connections_.end()) {
+    peer_set_changed_ = true;
+    ConnectToPeer(DialTarget{id, tcp_address, tcp_port, false, id});
+  }
+}
+
+// Runs with connections_mutex_ held. Dials without blocking: numeric
+// addresses are used as they are, and only host names go through the
+// resolver. The peer counts as connecting from here until it is verified,
+// and a dial that has not got that far within kConnectTimeout is abandoned
+// like any other lost dial. Dials to different peers proceed in parallel.
+void Network::ConnectToPeer(const DialTarget& target) {
+  const std::string& id = target.key;
+  auto connection = MakeConnection(
+      boost::asio::ip::tcp::socket(tcp_acceptor_.get_executor()));
+  unverified_connections_[id] = connection;
+  dial_targets_[connection.get()] = target;
+
+  auto timer =
+      std::make_shared<boost::asio::steady_timer>(io_context_, kConnectTimeout);
+  std::weak_ptr<Connection> weak_connection = connection;
+  timer->async_wait(boost::asio::bind_executor(
+      discovery_strand_, [this, timer, id, weak_connection](
+                             const boost::system::error_code& error) {
+        auto connection = weak_connection.lock();
+        if (error || !connection || !IsDialing(id, connection)) {
+          return;
+        }
+        std::cerr << "Timed out connecting to peer " << id << std::endl;
+        RemoveConnection(connection);
+      }));
+
+  boost::system::error_code error;
+  boost::asio::ip::address address =
+      boost::asio::ip::make_address(target.host, error);
+  if (!error) {
+    Connect(connection,
+            {boost::asio::ip::tcp::endpoint(address, target.port)});
+    return;
+  }
+
+  auto resolver =
+      std::make_shared<boost::asio::ip::tcp::resolver>(io_context_);
+  resolver->async_resolve(
+      target.host, std::to_string(target.port),
+      boost::asio::bind_executor(
+          discovery_strand_,
+          [this, resolver, id, connection](
+              const boost::system::error_code& error,
+              boost::asio::ip::tcp::resolver::results_type results) {
+            if (!IsDialing(id, connection)) {
+              return;
+            }
+            if (error) {
+              std::cerr << "Error resolving peer address: " << error.message()
+                        << std::endl;
+              RemoveConnection(connection);
+              return;
+            }
+            Connect(connection, std::vector<boost::asio::ip::tcp::endpoint>(
+                                    results.begin(), results.end()));
+          }));
+}
+
+// Runs with connections_mutex_ held. Dials a lost peer again unless it is
+// already connected or being dialed. The delay doubles with each attempt
+// that fails and is jittered, so peers that lost each other at the same
+// moment do not redial in lockstep.
+void Network::ScheduleRedial(const DialTarget& target) {
+  if (StandBy(target)) {
+    return;
+  }
+  unsigned& attempts = redial_attempts_[target.key];
+  if (!target.static_peer && attempts >= kMaxRedials) {
+    redial_attempts_.erase(target.key);
+    return;
+  }
+
+  std::chrono::milliseconds delay = config_.reconnect_delay;
+  for (unsigned i = 0; i < attempts && delay < config_.max_reconnect_delay;
+       ++i) {
+    delay *= 2;
+  }
+  delay = std::min(delay, config_.max_reconnect_delay);
+  ++attempts;
+  std::uniform_real_distribution<double> jitter(0.5, 1.0);
+  auto timer = std::make_shared<boost::asio::steady_timer>(
+      io_context_, std::chrono::duration_cast<std::chrono::milliseconds>(
+                       delay * jitter(redial_jitter_)));
+  timer->async_wait(boost::asio::bind_executor(
+      discovery_strand_,
+      [this, timer, target](const boost::system::error_code& error) {
+        if (error) {
+          return;
+        }
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        if (StandBy(target)) {
+          return;
+        }
+        std::cout << "Redialing peer " << target.key << std::endl;
+        ConnectToPeer(target);
+      }));
+}
+
+// Runs with connections_mutex_ held. True if there is no need to dial the
+// target because it is already being dialed or its peer is connected, in
+// which case a static target stands by until the peer is lost.
+bool Network::StandBy(const DialTarget& target) {
+  if (unverified_connections_.find(target.key) !=
+      unverified_connections_.end()) {
+    return true;
+  }
+  if (target.peer_id.empty() ||
+      connections_.find(target.peer_id) == connections_.end()) {
+    return false;
+  }
+  if (target.static_peer) {
+    standby_dials_.emplace(target.peer_id, target);
+  }
+  return true;
+}
+
+// Runs with connections_mutex_ held. Events are posted to discovery_strand_
+// so each peer's arrive in order and the callback may call back into the
+// network.
+void Network::NotifyLiveness(const std::string& peer_id, bool alive) {
+  if (!liveness_callback_) {
+    return;
+  }
+  boost::asio::post(discovery_strand_,
+                    [callback = liveness_callback_, peer_id, alive]() {
+                      callback(peer_id, alive);
+                    });
+}
+
+// Drops the sequence numbers expected from a lost peer on every topic.
+void Network::ForgetDatagramSequences(const std::string& peer_id) {
+  boost::asio::post(datagram_strand_, [this, prefix = peer_id + "/"]() {
+    for (auto it = datagram_next_sequence_.begin();
+         it != datagram_next_sequence_.end();) {
+      if (it->first.compare(0, prefix.size(), prefix) == 0) {
+        it = datagram_next_sequence_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  });
 }
 
-void Network::ConnectToPeer(const UdpPong& msg) {
-  auto socket = std::make_shared<boost::asio::ip::tcp::socket>(
-      tcp_acceptor_.get_executor());
-  boost::asio::ip::tcp::resolver resolver(tcp_acceptor_.get_executor());
-  auto endpoints =
-      resolver.resolve(msg.tcp_address_, std::to_string(msg.tcp_port_));
+// True until the dial is verified, fails, times out or loses to a
+// connection dialed by the peer.
+bool Network::IsDialing(const std::string& id,
+                        const std::shared_ptr<Connection>& connection) {
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  auto dial = unverified_connections_.find(id);
+  return dial != unverified_connections_.end() && dial->second == connection;
+}
 
+void Network::Connect(
+    std::shared_ptr<Connection> connection,
+    const std::vector<boost::asio::ip::tcp::endpoint>& endpoints) {
   boost::asio::async_connect(
-      *socket, endpoints,
+      connection->Socket(), endpoints,
       boost::asio::bind_executor(
-          strand_,
-          [this, socket, msg](const boost::system::error_code& error,
-                              const boost::asio::ip::tcp::endpoint& endpoint) {
+          discovery_strand_,
+          [this, connection](
+              const boost::system::error_code& error,
+              const boost::asio::ip::tcp::endpoint& endpoint) {
             if (!error) {
               std::cout << "Connected to " << endpoint.address().to_string()
                         << ":" << endpoint.port() << std::endl;
-              {
-                std::lock_guard<std::mutex> lock(tcp_sockets_mutex_);
-                unverified_tcp_sockets_[msg.id_] = socket;
-              }
-              StartReceivingTcpMessages(socket);
-              SendTcpPing(socket);
+              connection->StartReceiving();
+              SendTcpPing(connection);
             } else {
               std::cerr << "Error connecting to peer: " << error.message()
                         << std::endl;
+              RemoveConnection(connection);
             }
           }));
 }
 
-void Network::StartReceivingTcpMessages(
-    std::shared_ptr<boost::asio::ip::tcp::socket> socket) {
-  auto header_buffer = std::make_shared<std::array<char, 4>>();
-  boost::asio::async_read(
-      *socket, boost::asio::buffer(*header_buffer),
-      boost::asio::bind_executor(
-          strand_,
-          [this, socket, header_buffer](const boost::system::error_code& error,
-                                        std::size_t size) {
-            if (error) {
-              HandleTcpError(socket, error);
-              return;
-            }
+std::shared_ptr<Connection> Network::MakeConnection(
+    boost::asio::ip::tcp::socket socket) {
+  auto connection = std::make_shared<Connection>(std::move(socket),
+                                                 io_context_, buffer_pool_);
+  connection->SetMaxMessageSize(max_message_size_.load());
+  connection->SetHeartbeat(config_.heartbeat_interval,
+                           config_.heartbeat_misses);
+  connection->SetErrorHandler(
+      [this](std::shared_ptr<Connection> connection,
+             const boost::system::error_code& error) {
+        HandleTcpError(connection, error);
+      });
+  connection->SetFrameHandler(
+      [this](std::shared_ptr<Connection> connection, ByteReader& reader) {
+        ProcessTcpMessage(reader, connection);
+      });
+  connection->SetThrottleHandler(
+      [this](std::shared_ptr<Connection> connection, bool throttled) {
+        HandleThrottle(connection, throttled);
+      });
+  return connection;
+}
 
-            std::vector<char> header_vec(header_buffer->begin(),
-                                         header_buffer->begin() + size);
-            uint32_t packet_size = UInt32::Deserialize(header_vec);
+void Network::HandleTcpError(std::shared_ptr<Connection> connection,
+                             const boost::system::error_code& error) {
+  std::cerr << "TCP error: " << error.message() << std::endl;
+  RemoveConnection(connection);
+}
 
-            auto message_buffer =
-                std::make_shared<std::vector<char>>(packet_size);
-            boost::asio::async_read(
-                *socket, boost::asio::buffer(*message_buffer),
-                boost::asio::bind_executor(
-                    strand_, [this, socket, message_buffer](
-                                 const boost::system::error_code& error,
-                                 std::size_t size) {
-                      if (error) {
-                        HandleTcpError(socket, error);
-                        return;
-                      }
-
-                      ProcessTcpMessage(*message_buffer, socket);
-                      StartReceivingTcpMessages(socket);
-                    }));
-          }));
+void Network::HandleThrottle(std::shared_ptr<Connection> connection,
+                             bool throttled) {
+  std::string peer_id;
+  ThrottleCallback throttle_callback;
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    for (const auto& [id, peer] : connections_) {
+      if (peer == connection) {
+        peer_id = id;
+        break;
+      }
+    }
+    throttle_callback = throttle_callback_;
+  }
+
+  std::cerr << "Peer " << peer_id
+            << (throttled ? " is being throttled" : " is no longer throttled")
+            << std::endl;
+  if (throttle_callback) {
+    throttle_callback(peer_id, throttled);
+  }
 }
 
-void Network::HandleTcpError(
-    std::shared_ptr<boost::asio::ip::tcp::socket> socket,
-    const boost::system::error_code& error) {
-  std::cerr << "TCP error: " << error.message() << std::endl;
-  std::lock_guard<std::mutex> lock(tcp_sockets_mutex_);
-  for (auto it = connecting_tcp_sockets_.begin();
-       it != connecting_tcp_sockets_.end();) {
-    if (it->second == socket) {
+void Network::RemoveConnection(std::shared_ptr<Connection> connection) {
+  connection->Close();
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  std::vector<std::string> lost;
+  for (auto it = connections_.begin(); it != connections_.end();) {
+    if (it->second == connection) {
       std::cout << "Removing disconnected peer: " << it->first << std::endl;
-      it = connecting_tcp_sockets_.erase(it);
+      RemovePeerSubscriptions(it->first);
+      udp_peers_.erase(it->first);
+      ForgetDatagramSequences(it->first);
+      NotifyLiveness(it->first, false);
+      lost.push_back(it->first);
+      it = connections_.erase(it);
+      peer_set_changed_ = true;
     } else {
       ++it;
     }
   }
-  for (auto it = unverified_tcp_sockets_.begin();
-       it != unverified_tcp_sockets_.end();) {
-    if (it->second == socket) {
+  for (auto it = unverified_connections_.begin();
+       it != unverified_connections_.end();) {
+    if (it->second == connection) {
       std::cout << "Removing unverified peer: " << it->first << std::endl;
-      it = unverified_tcp_sockets_.erase(it);
+      it = unverified_connections_.erase(it);
     } else {
       ++it;
     }
   }
+  auto dial = dial_targets_.find(connection.get());
+  if (dial != dial_targets_.end()) {
+    DialTarget target = std::move(dial->second);
+    dial_targets_.erase(dial);
+    ScheduleRedial(target);
+  }
+  for (const auto& id : lost) {
+    auto standby = standby_dials_.equal_range(id);
+    std::vector<DialTarget> targets;
+    for (auto it = standby.first; it != standby.second; ++it) {
+      targets.push_back(std::move(it->second));
+    }
+    standby_dials_.erase(standby.first, standby.second);
+    for (const auto& target : targets) {
+      ScheduleRedial(target);
+    }
+  }
+  UpdateTopicRoutes();
 }
 
-void Network::ProcessTcpMessage(
-    const std::vector<char>& packet,
-    std::shared_ptr<boost::asio::ip::tcp::socket> socket) {
-  std::vector<char> mutable_packet(packet.begin(), packet.end());
-  std::string message_type = String::Deserialize(mutable_packet);
+void Network::ProcessTcpMessage(ByteReader& reader,
+                                std::shared_ptr<Connection> connection) {
+  try {
+    ByteReader packet = reader;
+    FrameHeader header = FrameHeader::Deserialize(reader);
+    if (!CheckFrameHeader(header, packet, "TCP")) {
+      RemoveConnection(connection);
+      return;
+    }
 
-  if (message_type == "tcp_ping") {
-    HandleTcpPing(mutable_packet, socket);
-  } else if (message_type == "tcp_pong") {
-    HandleTcpPong(mutable_packet, socket);
-  } else if (message_type == "publication") {
-    HandlePublication(mutable_packet);
+    TcpHandler handler = tcp_handlers_[static_cast<uint8_t>(header.kind_)];
+    if (handler) {
+      (this->*handler)(reader, connection);
+    } else {
+      std::cerr << "Skipping TCP frame of unknown kind "
+                << static_cast<int>(header.kind_) << std::endl;
+    }
+  } catch (const std::out_of_range& error) {
+    std::cerr << "Malformed TCP message: " << error.what() << std::endl;
   }
 }
 
-void Network::HandleTcpPing(
-    std::vector<char>& packet,
-    std::shared_ptr<boost::asio::ip::tcp::socket> socket) {
-  TcpPing msg = TcpPing::Deserialize(packet);
+bool Network::CheckFrameHeader(const FrameHeader& header,
+                               const ByteReader& packet,
+                               const char* transport) {
+  if (header.magic_ == kProtocolMagic) {
+    if (header.version_ == kProtocolVersion) {
+      return true;
+    }
+    std::cerr << "Rejecting " << transport << " peer speaking protocol version "
+              << static_cast<int>(header.version_) << ", expected "
+              << static_cast<int>(kProtocolVersion) << std::endl;
+  } else if (FrameHeader::IsLegacy(packet)) {
+    std::cerr << "Rejecting " << transport
+              << " peer speaking the legacy string-tagged protocol"
+              << std::endl;
+  } else {
+    std::cerr << "Rejecting " << transport << " message with bad magic byte"
+              << std::endl;
+  }
+  return false;
+}
+
+void Network::HandleTcpPing(ByteReader& reader,
+                            std::shared_ptr<Connection> connection) {
+  TcpPing msg = TcpPing::Deserialize(reader);
 
   std::cout << "Got tcp_ping from " << msg.id_ << " " << msg.name_ << std::endl;
 
+  UpdatePeerSubscriptions(msg.id_, msg.subscribed_topics_,
+                          msg.multicast_topics_);
+
+  // A connection that loses to another one is still answered, so its
+  // dialer learns which peer it reached and closes it.
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    auto registered = connections_.find(msg.id_);
+    if (registered == connections_.end() ||
+        registered->second != connection) {
+      RegisterConnection(msg.id_, connection, false, msg.data_port_);
+    }
+  }
+
   TcpPong pong_msg;
   pong_msg.id_ = id_;
   pong_msg.name_ = name_;
-  pong_msg.udp_address_ = udp_socket_.local_endpoint().address().to_string();
-  pong_msg.udp_port_ = udp_socket_.local_endpoint().port();
-  pong_msg.tcp_address_ = tcp_acceptor_.local_endpoint().address().to_string();
-  pong_msg.tcp_port_ = tcp_acceptor_.local_endpoint().port();
+  pong_msg.udp_address_ = udp_local_endpoint_.address().to_string();
+  pong_msg.udp_port_ = udp_local_endpoint_.port();
+  pong_msg.tcp_address_ = tcp_local_endpoint_.address().to_string();
+  pong_msg.tcp_port_ = tcp_local_endpoint_.port();
+  pong_msg.data_port_ = unicast_local_endpoint_.port();
   pong_msg.subscribed_topics_ = pubsub_.GetOnlineSubscribedTopics();
+  pong_msg.multicast_topics_ = *std::atomic_load(&joined_multicast_topics_);
 
-  SendTcpMessage(socket, TcpPong::Serialize(pong_msg));
+  connection->Send(EncodeFrame(MessageKind::kTcpPong, pong_msg));
 }
 
-void Network::HandleTcpPong(
-    std::vector<char>& packet,
-    std::shared_ptr<boost::asio::ip::tcp::socket> socket) {
-  TcpPong msg = TcpPong::Deserialize(packet);
+void Network::HandleTcpPong(ByteReader& reader,
+                            std::shared_ptr<Connection> connection) {
+  TcpPong msg = TcpPong::Deserialize(reader);
 
   std::cout << "Received tcp_pong from " << msg.id_ << " " << msg.name_
             << std::endl;
 
-  UpdatePeerSubscriptions(msg.id_, msg.subscribed_topics_);
+  UpdatePeerSubscriptions(msg.id_, msg.subscribed_topics_,
+                          msg.multicast_topics_);
 
-  {
-    std::lock_guard<std::mutex> lock(tcp_sockets_mutex_);
-    connecting_tcp_sockets_[msg.id_] = socket;
-    unverified_tcp_sockets_.erase(msg.id_);
+  // Pongs to subscription updates arrive on registered connections, and
+  // those to abandoned dials on connections that are already closed. Dials
+  // to static peers are filed under their address rather than their id.
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  auto dial = std::find_if(
+      unverified_connections_.begin(), unverified_connections_.end(),
+      [&](const auto& entry) { return entry.second == connection; });
+  if (dial == unverified_connections_.end()) {
+    return;
+  }
+  if (dial->first != msg.id_) {
+    unverified_connections_.erase(dial);
+  }
+  auto target = dial_targets_.find(connection.get());
+  if (target != dial_targets_.end()) {
+    target->second.peer_id = msg.id_;
+    redial_attempts_.erase(target->second.key);
+  }
+  RegisterConnection(msg.id_, connection, true, msg.data_port_);
+}
+
+// Runs with connections_mutex_ held. Each pair of peers shares one
+// connection, the one dialed by the peer with the lower id. Only that peer
+// dials, but when both ends have dialed anyway each keeps the same one and
+// closes the other; a connection that finds no rival is kept either way. A
+// second connection made in the same direction as the registered one, such
+// as a stale dial accepted late, is closed since the registered one is
+// known to work. Returns false if the connection lost. A losing dial is
+// closed here, and an accepted one is left for its dialer to close.
+bool Network::RegisterConnection(const std::string& id,
+                                 std::shared_ptr<Connection> connection,
+                                 bool dialed, uint16_t data_port) {
+  bool preferred = dialed ? id_ < id : id < id_;
+  auto registered = connections_.find(id);
+  auto dial = unverified_connections_.find(id);
+  bool registered_rival =
+      registered != connections_.end() && registered->second != connection;
+  bool rival = registered_rival || (dial != unverified_connections_.end() &&
+                                    dial->second != connection);
+  if (registered_rival &&
+      (dial_targets_.find(registered->second.get()) != dial_targets_.end()) ==
+          dialed) {
+    preferred = false;
+  }
+  if (rival && !preferred) {
+    if (dial != unverified_connections_.end() && dial->second == connection) {
+      unverified_connections_.erase(dial);
+    }
+    if (dialed) {
+      std::cout << "Closing duplicate connection to peer " << id << std::endl;
+      CloseDuplicate(id, connection);
+    }
+    return false;
+  }
+
+  if (registered != connections_.end() && registered->second != connection) {
+    std::cout << "Closing duplicate connection to peer " << id << std::endl;
+    CloseDuplicate(id, registered->second);
+  }
+  if (dial != unverified_connections_.end()) {
+    if (dial->second != connection) {
+      CloseDuplicate(id, dial->second);
+    }
+    unverified_connections_.erase(dial);
   }
 
-  std::cout << "Verified tcp sockets: " << connecting_tcp_sockets_.size()
+  boost::system::error_code error;
+  boost::asio::ip::tcp::endpoint remote =
+      connection->Socket().remote_endpoint(error);
+  connection->SetQueueLimits(peer_queue_limits_);
+  connection->SetBatchOptions(peer_batch_options_);
+  if (!error && data_port != 0) {
+    auto peer = std::make_shared<UdpPeer>();
+    peer->endpoint =
+        boost::asio::ip::udp::endpoint(remote.address(), data_port);
+    udp_peers_[id] = peer;
+  }
+  if (registered == connections_.end()) {
+    NotifyLiveness(id, true);
+  }
+  connections_[id] = connection;
+  peer_set_changed_ = true;
+  UpdateTopicRoutes();
+  std::cout << "Verified tcp connections: " << connections_.size()
             << std::endl;
+  return true;
+}
+
+// Runs with connections_mutex_ held. A closed connection never reaches
+// RemoveConnection, so its dial is dealt with here: a dial to a static peer
+// stands by until the peer is lost, and any other is forgotten.
+void Network::CloseDuplicate(const std::string& id,
+                             const std::shared_ptr<Connection>& connection) {
+  connection->Close();
+  auto dial = dial_targets_.find(connection.get());
+  if (dial == dial_targets_.end()) {
+    return;
+  }
+  if (dial->second.static_peer) {
+    dial->second.peer_id = id;
+    standby_dials_.emplace(id, std::move(dial->second));
+  }
+  dial_targets_.erase(dial);
 }
 
-void Network::HandlePublication(std::vector<char>& packet) {
-  std::string topic = String::Deserialize(packet);
-  uint32_t message_size;
-  UInt32::Deserialize(packet, message_size);
-  std::vector<char> message(packet.begin(), packet.begin() + message_size);
-  pubsub_.PublishOnline(topic, message);
+void Network::HandleTopic(ByteReader& reader,
+                          std::shared_ptr<Connection> connection) {
+  uint32_t topic_id = VarUInt32::Deserialize(reader);
+  connection->SetRemoteTopic(topic_id, String::Deserialize(reader));
+}
+
+void Network::HandlePublication(ByteReader& reader,
+                                std::shared_ptr<Connection> connection) {
+  uint32_t topic_id = VarUInt32::Deserialize(reader);
+  const std::string* topic = connection->RemoteTopic(topic_id);
+  if (!topic) {
+    std::cerr << "Publication on unannounced topic id " << topic_id
+              << std::endl;
+    return;
+  }
+
+  pubsub_.PublishOnline(*topic, reader);
 }
 
-void Network::UpdatePeerSubscriptions(const std::string& peer_id,
-                                      const std::vector<std::string>& topics) {
+// Each entry is length prefixed, so one that fails to decode is skipped and
+// the rest of the batch is still delivered. A bad length leaves nothing to
+// resynchronize on and ends the batch.
+void Network::HandleBatch(ByteReader& reader,
+                          std::shared_ptr<Connection> connection) {
+  while (!reader.Empty()) {
+    uint32_t size = VarUInt32::Deserialize(reader);
+    ByteReader publication(reader.Read(size), size);
+    try {
+      HandlePublication(publication, connection);
+    } catch (const std::out_of_range& error) {
+      std::cerr << "Malformed batch entry: " << error.what() << std::endl;
+    }
+  }
+}
+
+void Network::UpdatePeerSubscriptions(
+    const std::string& peer_id, const std::vector<std::string>& topics,
+    const std::vector<std::string>& multicast_topics) {
   std::cout << "Updating subscriptions for peer " << peer_id << ":"
             << std::endl;
   for (const auto& topic : topics) {
     std::cout << "  " << topic << std::endl;
   }
+
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  RemovePeerSubscriptions(peer_id);
+  for (const auto& topic : topics) {
+    topic_peers_[topic].insert(peer_id);
+  }
+  peer_topics_[peer_id] = topics;
+  peer_multicast_topics_[peer_id] = std::unordered_set<std::string>(
+      multicast_topics.begin(), multicast_topics.end());
+  UpdateTopicRoutes();
 }
 
-void Network::SendTcpPing(
-    std::shared_ptr<boost::asio::ip::tcp::socket> socket) {
-  TcpPing ping;
-  ping.id_ = id_;
-  ping.name_ = name_;
-  ping.udp_address_ = udp_socket_.local_endpoint().address().to_string();
-  ping.udp_port_ = udp_socket_.local_endpoint().port();
-  ping.tcp_address_ = tcp_acceptor_.local_endpoint().address().to_string();
-  ping.tcp_port_ = tcp_acceptor_.local_endpoint().port();
-  ping.subscribed_topics_ = pubsub_.GetOnlineSubscribedTopics();
-  std::vector<char> packet = TcpPing::Serialize(ping);
+// Callers must hold connections_mutex_.
+void Network::RemovePeerSubscriptions(const std::string& peer_id) {
+  peer_multicast_topics_.erase(peer_id);
+  auto peer = peer_topics_.find(peer_id);
+  if (peer == peer_topics_.end()) {
+    return;
+  }
 
-  SendTcpMessage(socket, packet);
+  for (const auto& topic : peer->second) {
+    auto peers = topic_peers_.find(topic);
+    if (peers != topic_peers_.end()) {
+      peers->second.erase(peer_id);
+      if (peers->second.empty()) {
+        topic_peers_.erase(peers);
+      }
+    }
+  }
+  peer_topics_.erase(peer);
 }
 
-void Network::SendTcpMessage(
-    std::shared_ptr<boost::asio::ip::tcp::socket> socket,
-    const std::vector<char>& message) {
-  uint32_t size = message.size();
-  std::vector<char> buffer;
-  UInt32::Serialize(size, buffer);
-  buffer.insert(buffer.end(), message.begin(), message.end());
+// Callers must hold connections_mutex_. Publishers read the routes without
+// the lock, so they are rebuilt as a fresh snapshot rather than edited.
+void Network::UpdateTopicRoutes() {
+  auto routes = std::make_shared<TopicRoutes>();
+  auto unicast_routes = std::make_shared<UnicastRoutes>();
+  auto multicast_routes = std::make_shared<MulticastRoutes>();
+  for (const auto& [topic, peers] : topic_peers_) {
+    std::vector<std::shared_ptr<Connection>> route;
+    UnicastRoute unicast_route;
+    MulticastRoute multicast_route;
+    for (const auto& peer_id : peers) {
+      auto connection = connections_.find(peer_id);
+      if (connection == connections_.end()) {
+        continue;
+      }
+      route.push_back(connection->second);
+      auto udp_peer = udp_peers_.find(peer_id);
+      if (udp_peer != udp_peers_.end()) {
+        unicast_route.peers.push_back(udp_peer->second);
+      } else {
+        unicast_route.unreachable.push_back(connection->second);
+      }
+      auto joined = peer_multicast_topics_.find(peer_id);
+      if (joined != peer_multicast_topics_.end() &&
+          joined->second.count(topic)) {
+        multicast_route.joined = true;
+      } else {
+        multicast_route.unjoined.push_back(connection->second);
+      }
+    }
+    if (!route.empty()) {
+      routes->emplace(topic, std::move(route));
+      unicast_routes->emplace(topic, std::move(unicast_route));
+      multicast_routes->emplace(topic, std::move(multicast_route));
+    }
+  }
+  std::atomic_store(&topic_routes_,
+                    std::shared_ptr<const TopicRoutes>(std::move(routes)));
+  std::atomic_store(
+      &unicast_routes_,
+      std::shared_ptr<const UnicastRoutes>(std::move(unicast_routes)));
+  std::atomic_store(
+      &multicast_routes_,
+      std::shared_ptr<const MulticastRoutes>(std::move(multicast_routes)));
+}
 
-  boost::asio::async_write(
-      *socket, boost::asio::buffer(buffer),
-      boost::asio::bind_executor(
-          strand_, [this, socket](const boost::system::error_code& error,
-                                  std::size_t size) {
-            if (error) {
-              std::cerr << "Error sending TCP message: " << error.message()
-                        << std::endl;
-              HandleTcpError(socket, error);
-            }
-          }));
+bool Network::HasRemoteSubscribers(const std::string& topic) {
+  auto routes = std::atomic_load(&topic_routes_);
+  return routes->find(topic) != routes->end();
+}
+
+Network::LocalTopic Network::InternTopic(const std::string& topic) {
+  std::lock_guard<std::mutex> lock(local_topics_mutex_);
+  auto local_topic = local_topics_.find(topic);
+  if (local_topic != local_topics_.end()) {
+    return local_topic->second;
+  }
+
+  uint32_t topic_id = local_topics_.size();
+  FrameHeader header(MessageKind::kTopic);
+  uint32_t packet_size = FrameHeader::EncodedSize(header) +
+                         VarUInt32::EncodedSize(topic_id) +
+                         String::EncodedSize(topic);
+  Frame announcement =
+      buffer_pool_->Acquire(UInt32::EncodedSize(packet_size) + packet_size);
+  ByteWriter writer(*announcement);
+  UInt32::Serialize(packet_size, writer);
+  FrameHeader::Serialize(header, writer);
+  VarUInt32::Serialize(topic_id, writer);
+  String::Serialize(topic, writer);
+
+  LocalTopic entry{topic_id, announcement, TopicOptions(),
+                   std::make_shared<std::atomic<uint64_t>>(0)};
+  auto options = topic_options_.find(topic);
+  if (options != topic_options_.end()) {
+    entry.options = options->second;
+  }
+  local_topics_.emplace(topic, entry);
+  return entry;
+}
+
+TopicOptions Network::FindTopicOptions(const std::string& topic) {
+  std::lock_guard<std::mutex> lock(local_topics_mutex_);
+  auto options = topic_options_.find(topic);
+  if (options == topic_options_.end()) {
+    return TopicOptions();
+  }
+  return options->second;
+}
+
+// Maps the topic into the organization-local scope 239.255.0.0/16 with a
+// 32-bit FNV-1a hash. Topics sharing a group are told apart by the topic
+// carried in each datagram.
+boost::asio::ip::address_v4 Network::MulticastGroup(const std::string& topic) {
+  uint32_t hash = 2166136261u;
+  for (char c : topic) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 16777619u;
+  }
+  return boost::asio::ip::address_v4(0xEFFF0000u | (hash & 0xFFFFu));
+}
+
+// Returns the connections to subscribed peers that have not joined the
+// topic's group, which need the publication over TCP instead.
+std::vector<std::shared_ptr<Connection>> Network::SendMulticast(
+    const std::string& topic, const Frame& datagram) {
+  auto routes = std::atomic_load(&multicast_routes_);
+  auto route = routes->find(topic);
+  if (route == routes->end()) {
+    return {};
+  }
+
+  if (route->second.joined) {
+    SendDatagram(datagram,
+                 boost::asio::ip::udp::endpoint(MulticastGroup(topic),
+                                                config_.multicast_port),
+                 multicast_counters_);
+  }
+  return route->second.unjoined;
+}
+
+// Returns the connections to subscribed peers without a data channel, which
+// need the publication over TCP instead.
+std::vector<std::shared_ptr<Connection>> Network::SendUnicast(
+    const std::string& topic, const Frame& datagram) {
+  auto routes = std::atomic_load(&unicast_routes_);
+  auto route = routes->find(topic);
+  if (route == routes->end()) {
+    return {};
+  }
+
+  for (const auto& peer : route->second.peers) {
+    SendDatagram(datagram, peer->endpoint, peer->counters);
+  }
+  return route->second.unreachable;
+}
+
+void Network::SendDatagram(const Frame& datagram,
+                           const boost::asio::ip::udp::endpoint& endpoint,
+                           DatagramCounters& counters) {
+  boost::system::error_code error;
+  {
+    std::lock_guard<std::mutex> lock(datagram_send_mutex_);
+    datagram_send_socket_.send_to(boost::asio::buffer(*datagram), endpoint, 0,
+                                  error);
+  }
+  if (error) {
+    ++counters.dropped;
+  } else {
+    ++counters.sent;
+  }
 }
 
-void Network::SendPublication(
-    std::shared_ptr<boost::asio::ip::tcp::socket> socket,
-    const std::string& topic, const std::vector<char>& message) {
-  std::vector<char> packet;
-  String::Serialize("publication", packet);
-  String::Serialize(topic, packet);
-  UInt32::Serialize(message.size(), packet);
-  packet.insert(packet.end(), message.begin(), message.end());
+// Callers must hold pubsub_mutex_. Nodes without multicast topics never
+// bind the shared multicast port.
+bool Network::OpenMulticastSocket() {
+  if (multicast_socket_.is_open()) {
+    return true;
+  }
+
+  boost::system::error_code error;
+  multicast_socket_.open(boost::asio::ip::udp::v4(), error);
+  if (!error) {
+    multicast_socket_.set_option(
+        boost::asio::ip::udp::socket::reuse_address(true), error);
+  }
+  if (!error) {
+    multicast_socket_.bind(boost::asio::ip::udp::endpoint(
+                               boost::asio::ip::udp::v4(),
+                               config_.multicast_port),
+                           error);
+  }
+  if (error) {
+    std::cerr << "Error opening multicast socket on port "
+              << config_.multicast_port << ": " << error.message()
+              << std::endl;
+    boost::system::error_code ignored;
+    multicast_socket_.close(ignored);
+    return false;
+  }
 
-  SendTcpMessage(socket, packet);
+  StartReceivingDatagrams(multicast_socket_, multicast_buffer_,
+                          Transport::kMulticast);
+  return true;
+}
+
+// Callers must hold pubsub_mutex_. Subscriptions to topics that share a group
+// share its membership.
+void Network::JoinMulticastGroup(const std::string& topic,
+                                 const Subscription& subscription) {
+  if (!OpenMulticastSocket()) {
+    return;
+  }
+
+  boost::asio::ip::address_v4 group = MulticastGroup(topic);
+  if (multicast_group_members_[group.to_uint()] == 0) {
+    boost::system::error_code error;
+    multicast_socket_.set_option(
+        boost::asio::ip::multicast::join_group(group), error);
+    if (error) {
+      std::cerr << "Error joining multicast group " << group.to_string()
+                << " for topic " << topic << ": " << error.message()
+                << std::endl;
+      multicast_group_members_.erase(group.to_uint());
+      return;
+    }
+  }
+  ++multicast_group_members_[group.to_uint()];
+  multicast_subscriptions_[subscription.id_] = topic;
+  if (multicast_topic_members_[topic]++ == 0) {
+    UpdateJoinedMulticastTopics();
+  }
+}
+
+// Callers must hold pubsub_mutex_.
+void Network::LeaveMulticastGroup(const Subscription& subscription) {
+  auto joined = multicast_subscriptions_.find(subscription.id_);
+  if (joined == multicast_subscriptions_.end()) {
+    return;
+  }
+  std::string topic = std::move(joined->second);
+  multicast_subscriptions_.erase(joined);
+  if (--multicast_topic_members_[topic] == 0) {
+    multicast_topic_members_.erase(topic);
+    UpdateJoinedMulticastTopics();
+  }
+  uint32_t group = MulticastGroup(topic).to_uint();
+  if (--multicast_group_members_[group] > 0) {
+    return;
+  }
+
+  multicast_group_members_.erase(group);
+  boost::system::error_code error;
+  multicast_socket_.set_option(boost::asio::ip::multicast::leave_group(
+                                   boost::asio::ip::address_v4(group)),
+                               error);
+}
+
+// Callers must hold pubsub_mutex_.
+void Network::UpdateJoinedMulticastTopics() {
+  auto topics = std::make_shared<std::vector<std::string>>();
+  for (const auto& [topic, members] : multicast_topic_members_) {
+    topics->push_back(topic);
+  }
+  std::atomic_store(&joined_multicast_topics_,
+                    std::shared_ptr<const std::vector<std::string>>(
+                        std::move(topics)));
+}
+
+PublishStatus Network::SendToSubscribers(const std::string& topic,
+                                         const LocalTopic& local_topic,
+                                         const Frame& frame) {
+  auto routes = std::atomic_load(&topic_routes_);
+  auto route = routes->find(topic);
+  if (route == routes->end()) {
+    return PublishStatus::kOk;
+  }
+
+  return SendPublication(route->second, local_topic, frame);
+}
+
+PublishStatus Network::SendPublication(
+    const std::vector<std::shared_ptr<Connection>>& connections,
+    const LocalTopic& local_topic, const Frame& frame) {
+  PublishStatus status = PublishStatus::kOk;
+  for (const auto& connection : connections) {
+    status = std::max(status, connection->SendPublication(
+                                  local_topic.id, local_topic.announcement,
+                                  frame, local_topic.options));
+  }
+  return status;
+}
+
+void Network::SendTcpPing(std::shared_ptr<Connection> connection) {
+  TcpPing ping;
+  ping.id_ = id_;
+  ping.name_ = name_;
+  ping.udp_address_ = udp_local_endpoint_.address().to_string();
+  ping.udp_port_ = udp_local_endpoint_.port();
+  ping.tcp_address_ = tcp_local_endpoint_.address().to_string();
+  ping.tcp_port_ = tcp_local_endpoint_.port();
+  ping.data_port_ = unicast_local_endpoint_.port();
+  ping.subscribed_topics_ = pubsub_.GetOnlineSubscribedTopics();
+  ping.multicast_topics_ = *std::atomic_load(&joined_multicast_topics_);
+  connection->Send(EncodeFrame(MessageKind::kTcpPing, ping));
 }
 
 void Network::BroadcastSubscriptionUpdate() {
   TcpPing ping;
   ping.id_ = id_;
   ping.name_ = name_;
-  ping.udp_address_ = udp_socket_.local_endpoint().address().to_string();
-  ping.udp_port_ = udp_socket_.local_endpoint().port();
-  ping.tcp_address_ = tcp_acceptor_.local_endpoint().address().to_string();
-  ping.tcp_port_ = tcp_acceptor_.local_endpoint().port();
+  ping.udp_address_ = udp_local_endpoint_.address().to_string();
+  ping.udp_port_ = udp_local_endpoint_.port();
+  ping.tcp_address_ = tcp_local_endpoint_.address().to_string();
+  ping.tcp_port_ = tcp_local_endpoint_.port();
+  ping.data_port_ = unicast_local_endpoint_.port();
   ping.subscribed_topics_ = pubsub_.GetOnlineSubscribedTopics();
+  ping.multicast_topics_ = *std::atomic_load(&joined_multicast_topics_);
 
-  std::vector<char> packet = TcpPing::Serialize(ping);
+  Frame frame = EncodeFrame(MessageKind::kTcpPing, ping);
 
-  std::lock_guard<std::mutex> lock(tcp_sockets_mutex_);
-  for (const auto& [id, socket] : connecting_tcp_sockets_) {
-    SendTcpMessage(socket, packet);
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  for (const auto& [id, connection] : connections_) {
+    connection->Send(frame);
   }
 }
 
@@ -414,10 +1282,10 @@ void Network::UnsubscribeOffline(const std::string& topic,
   UnsubscribeOffline(*instance, topic, subscription);
 }
 
-void Network::UnsubscribeOffline(Network& network, const std::string& topic,
+void Network::UnsubscribeOffline(Network& network, const std::string&,
                                  const Subscription& subscription) {
   std::lock_guard<std::mutex> lock(network.pubsub_mutex_);
-  network.pubsub_.UnsubscribeOffline(topic, subscription);
+  network.pubsub_.UnsubscribeOffline(subscription);
 }
 
 void Network::UnsubscribeOnline(const std::string& topic,
@@ -430,10 +1298,12 @@ void Network::UnsubscribeOnline(const std::string& topic,
   UnsubscribeOnline(*instance, topic, subscription);
 }
 
-void Network::UnsubscribeOnline(Network& network, const std::string& topic,
+void Network::UnsubscribeOnline(Network& network, const std::string&,
                                 const Subscription& subscription) {
   std::lock_guard<std::mutex> lock(network.pubsub_mutex_);
-  network.pubsub_.UnsubscribeOnline(topic, subscription);
+  network.pubsub_.UnsubscribeOnline(subscription);
+  network.StopDispatchQueue(subscription);
+  network.LeaveMulticastGroup(subscription);
   network.BroadcastSubscriptionUpdate();
 }
 
@@ -447,31 +1317,286 @@ void Network::Unsubscribe(const std::string& topic,
   Unsubscribe(*instance, topic, subscription);
 }
 
-void Network::Unsubscribe(Network& network, const std::string& topic,
+void Network::Unsubscribe(Network& network, const std::string&,
                              const Subscription& subscription) {
   std::lock_guard<std::mutex> lock(network.pubsub_mutex_);
-  network.pubsub_.Unsubscribe(topic, subscription);
+  network.pubsub_.Unsubscribe(subscription);
+  network.StopDispatchQueue(subscription);
+  network.LeaveMulticastGroup(subscription);
   network.BroadcastSubscriptionUpdate();
 }
 
-Network::Network(boost::asio::io_context& io_context, const std::string& name,
-                 bool)
+// Callers must hold pubsub_mutex_. Messages already queued for the
+// subscription are dropped rather than delivered after it has gone.
+void Network::StopDispatchQueue(const Subscription& subscription) {
+  auto queue = dispatch_queues_.find(subscription.id_);
+  if (queue != dispatch_queues_.end()) {
+    queue->second->Stop();
+    dispatch_queues_.erase(queue);
+  }
+}
+
+void Network::SetTopicOptions(const std::string& topic,
+                              const TopicOptions& options) {
+  if (!instance) {
+    std::cout << "Initialize a network instance first" << std::endl;
+    return;
+  }
+
+  SetTopicOptions(*instance, topic, options);
+}
+
+void Network::SetTopicOptions(Network& network, const std::string& topic,
+                              const TopicOptions& options) {
+  std::lock_guard<std::mutex> lock(network.local_topics_mutex_);
+  network.topic_options_[topic] = options;
+  auto local_topic = network.local_topics_.find(topic);
+  if (local_topic != network.local_topics_.end()) {
+    local_topic->second.options = options;
+  }
+}
+
+void Network::SetPeerQueueLimits(const QueueLimits& limits) {
+  if (!instance) {
+    std::cout << "Initialize a network instance first" << std::endl;
+    return;
+  }
+
+  SetPeerQueueLimits(*instance, limits);
+}
+
+void Network::SetPeerQueueLimits(Network& network, const QueueLimits& limits) {
+  std::lock_guard<std::mutex> lock(network.connections_mutex_);
+  network.peer_queue_limits_ = limits;
+  for (const auto& [id, connection] : network.connections_) {
+    connection->SetQueueLimits(limits);
+  }
+}
+
+void Network::SetThrottleCallback(ThrottleCallback callback) {
+  if (!instance) {
+    std::cout << "Initialize a network instance first" << std::endl;
+    return;
+  }
+
+  SetThrottleCallback(*instance, std::move(callback));
+}
+
+void Network::SetThrottleCallback(Network& network,
+                                  ThrottleCallback callback) {
+  std::lock_guard<std::mutex> lock(network.connections_mutex_);
+  network.throttle_callback_ = std::move(callback);
+}
+
+void Network::SetLivenessCallback(LivenessCallback callback) {
+  if (!instance) {
+    std::cout << "Initialize a network instance first" << std::endl;
+    return;
+  }
+
+  SetLivenessCallback(*instance, std::move(callback));
+}
+
+void Network::SetLivenessCallback(Network& network,
+                                  LivenessCallback callback) {
+  std::lock_guard<std::mutex> lock(network.connections_mutex_);
+  network.liveness_callback_ = std::move(callback);
+}
+
+void Network::SetPeerBatching(const BatchOptions& options) {
+  if (!instance) {
+    std::cout << "Initialize a network instance first" << std::endl;
+    return;
+  }
+
+  SetPeerBatching(*instance, options);
+}
+
+void Network::SetPeerBatching(Network& network, const BatchOptions& options) {
+  std::lock_guard<std::mutex> lock(network.connections_mutex_);
+  network.peer_batch_options_ = options;
+  for (const auto& [id, connection] : network.connections_) {
+    connection->SetBatchOptions(options);
+  }
+}
+
+void Network::SetMaxMessageSize(std::size_t size) {
+  if (!instance) {
+    std::cout << "Initialize a network instance first" << std::endl;
+    return;
+  }
+
+  SetMaxMessageSize(*instance, size);
+}
+
+void Network::SetMaxMessageSize(Network& network, std::size_t size) {
+  std::lock_guard<std::mutex> lock(network.connections_mutex_);
+  network.max_message_size_.store(size);
+  for (const auto& [id, connection] : network.connections_) {
+    connection->SetMaxMessageSize(size);
+  }
+  for (const auto& [id, connection] : network.unverified_connections_) {
+    connection->SetMaxMessageSize(size);
+  }
+}
+
+Connection::QueueStats Network::GetPeerQueueStats(const std::string& peer_id) {
+  if (!instance) {
+    std::cout << "Initialize a network instance first" << std::endl;
+    return Connection::QueueStats{};
+  }
+
+  return GetPeerQueueStats(*instance, peer_id);
+}
+
+Connection::QueueStats Network::GetPeerQueueStats(Network& network,
+                                                  const std::string& peer_id) {
+  std::shared_ptr<Connection> connection;
+  {
+    std::lock_guard<std::mutex> lock(network.connections_mutex_);
+    auto peer = network.connections_.find(peer_id);
+    if (peer == network.connections_.end()) {
+      return Connection::QueueStats{};
+    }
+    connection = peer->second;
+  }
+  return connection->GetQueueStats();
+}
+
+std::size_t Network::GetQueueDepth(const Subscription& subscription) {
+  if (!instance) {
+    std::cout << "Initialize a network instance first" << std::endl;
+    return 0;
+  }
+
+  return GetQueueDepth(*instance, subscription);
+}
+
+std::size_t Network::GetQueueDepth(Network& network,
+                                   const Subscription& subscription) {
+  std::lock_guard<std::mutex> lock(network.pubsub_mutex_);
+  auto queue = network.dispatch_queues_.find(subscription.id_);
+  if (queue == network.dispatch_queues_.end()) {
+    return 0;
+  }
+  return queue->second->Depth();
+}
+
+BufferPool::Stats Network::GetBufferPoolStats() {
+  if (!instance) {
+    std::cout << "Initialize a network instance first" << std::endl;
+    return BufferPool::Stats{};
+  }
+
+  return GetBufferPoolStats(*instance);
+}
+
+BufferPool::Stats Network::GetBufferPoolStats(Network& network) {
+  return network.buffer_pool_->GetStats();
+}
+
+Network::DatagramStats Network::GetMulticastStats() {
+  if (!instance) {
+    std::cout << "Initialize a network instance first" << std::endl;
+    return DatagramStats{};
+  }
+
+  return GetMulticastStats(*instance);
+}
+
+Network::DatagramStats Network::GetMulticastStats(Network& network) {
+  return network.multicast_counters_.Load();
+}
+
+Network::DatagramStats Network::GetUnicastStats(const std::string& peer_id) {
+  if (!instance) {
+    std::cout << "Initialize a network instance first" << std::endl;
+    return DatagramStats{};
+  }
+
+  return GetUnicastStats(*instance, peer_id);
+}
+
+Network::DatagramStats Network::GetUnicastStats(Network& network,
+                                                const std::string& peer_id) {
+  std::lock_guard<std::mutex> lock(network.connections_mutex_);
+  auto peer = network.udp_peers_.find(peer_id);
+  if (peer == network.udp_peers_.end()) {
+    return DatagramStats{};
+  }
+  return peer->second->counters.Load();
+}
+
+Network::DatagramStats Network::DatagramCounters::Load() const {
+  return DatagramStats{sent, dropped, received, lost, late};
+}
+
+Network::Network(boost::asio::io_context& io_context,
+                 const NetworkConfig& config, bool)
     : io_context_(io_context),
-      name_(name),
+      config_(config),
       udp_socket_(io_context),
       tcp_acceptor_(io_context),
+      multicast_socket_(io_context),
+      unicast_socket_(io_context),
+      datagram_send_socket_(io_context),
       cycle_discovery_messages_timer_(io_context),
+      discovery_interval_(config.discovery_interval),
+      peer_set_changed_(false),
+      peer_queue_limits_{Connection::kDefaultMaxQueuedBytes,
+                         Connection::kDefaultMaxQueuedMessages},
+      max_message_size_(Connection::kDefaultMaxMessageSize),
+      redial_jitter_(std::random_device()()),
+      topic_routes_(std::make_shared<const TopicRoutes>()),
+      unicast_routes_(std::make_shared<const UnicastRoutes>()),
+      multicast_routes_(std::make_shared<const MulticastRoutes>()),
+      multicast_buffer_(kMaxDatagramSize),
+      unicast_buffer_(kMaxDatagramSize),
+      joined_multicast_topics_(
+          std::make_shared<const std::vector<std::string>>()),
       id_(GenerateId()),
+      name_(config.name),
+      dispatcher_(config.dispatcher ? config.dispatcher
+                                    : std::make_shared<Dispatcher>()),
       pubsub_(),
-      strand_(io_context) {
+      buffer_pool_(std::make_shared<BufferPool>()),
+      discovery_strand_(io_context),
+      datagram_strand_(io_context) {
   std::cout << "Initialized down here" << std::endl;
-  InitializeUdpSocket();
   InitializeTcpAcceptor();
-  StartReceivingUdpMessages();
+  InitializeDatagramSockets();
+  StartReceivingDatagrams(unicast_socket_, unicast_buffer_, Transport::kUdp);
   StartAcceptingTcpConnections();
-  StartCyclingDiscoveryMessages();
+  DialStaticPeers();
+  if (config_.discovery) {
+    InitializeUdpSocket();
+    StartReceivingUdpMessages();
+    StartCyclingDiscoveryMessages();
+  }
 }
 
 std::unique_ptr<Network> Network::instance = nullptr;
 
+const std::array<Network::UdpHandler, 256> Network::udp_handlers_ = [] {
+  std::array<UdpHandler, 256> handlers{};
+  handlers[static_cast<uint8_t>(MessageKind::kUdpPing)] =
+      &Network::HandleUdpPing;
+  handlers[static_cast<uint8_t>(MessageKind::kUdpPong)] =
+      &Network::HandleUdpPong;
+  return handlers;
+}();
+
+const std::array<Network::TcpHandler, 256> Network::tcp_handlers_ = [] {
+  std::array<TcpHandler, 256> handlers{};
+  handlers[static_cast<uint8_t>(MessageKind::kTcpPing)] =
+      &Network::HandleTcpPing;
+  handlers[static_cast<uint8_t>(MessageKind::kTcpPong)] =
+      &Network::HandleTcpPong;
+  handlers[static_cast<uint8_t>(MessageKind::kTopic)] = &Network::HandleTopic;
+  handlers[static_cast<uint8_t>(MessageKind::kPublication)] =
+      &Network::HandlePublication;
+  handlers[static_cast<uint8_t>(MessageKind::kBatch)] = &Network::HandleBatch;
+  return handlers;
+}();
+
 }  // namespace farfler::network
\ No newline at end of file
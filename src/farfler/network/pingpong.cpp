@@ -12,24 +12,39 @@ UdpPing::UdpPing(const std::string& id, const std::string& name,
       tcp_address_(tcp_address),
       tcp_port_(tcp_port) {}
 
+std::size_t UdpPing::EncodedSize(const UdpPing& msg) {
+  return String::EncodedSize(msg.id_) +
+         String::EncodedSize(msg.name_) +
+         String::EncodedSize(msg.udp_address_) +
+         UInt16::EncodedSize(msg.udp_port_) +
+         String::EncodedSize(msg.tcp_address_) +
+         UInt16::EncodedSize(msg.tcp_port_);
+}
+
 std::vector<char> UdpPing::Serialize(const UdpPing& msg) {
   std::vector<char> packet;
   Serialize(msg, packet);
   return packet;
 }
 
-std::vector<char> UdpPing::Serialize(const UdpPing& msg,
-                                     std::vector<char>& packet) {
-  String::Serialize("udp_ping", packet);
-  String::Serialize(msg.id_, packet);
-  String::Serialize(msg.name_, packet);
-  String::Serialize(msg.udp_address_, packet);
-  UInt16::Serialize(msg.udp_port_, packet);
-  String::Serialize(msg.tcp_address_, packet);
-  UInt16::Serialize(msg.tcp_port_, packet);
+std::vector<char>& UdpPing::Serialize(const UdpPing& msg,
+                                      std::vector<char>& packet) {
+  std::size_t offset = packet.size();
+  packet.resize(offset + EncodedSize(msg));
+  ByteWriter writer(packet.data() + offset, packet.size() - offset);
+  Serialize(msg, writer);
   return packet;
 }
 
+void UdpPing::Serialize(const UdpPing& msg, ByteWriter& writer) {
+  String::Serialize(msg.id_, writer);
+  String::Serialize(msg.name_, writer);
+  String::Serialize(msg.udp_address_, writer);
+  UInt16::Serialize(msg.udp_port_, writer);
+  String::Serialize(msg.tcp_address_, writer);
+  UInt16::Serialize(msg.tcp_port_, writer);
+}
+
 UdpPing UdpPing::Deserialize(std::vector<char>& packet) {
   UdpPing msg;
   Deserialize(packet, msg);
@@ -37,12 +52,25 @@ UdpPing UdpPing::Deserialize(std::vector<char>& packet) {
 }
 
 UdpPing UdpPing::Deserialize(std::vector<char>& packet, UdpPing& msg) {
-  String::Deserialize(packet, msg.id_);
-  String::Deserialize(packet, msg.name_);
-  String::Deserialize(packet, msg.udp_address_);
-  UInt16::Deserialize(packet, msg.udp_port_);
-  String::Deserialize(packet, msg.tcp_address_);
-  UInt16::Deserialize(packet, msg.tcp_port_);
+  ByteReader reader(packet);
+  Deserialize(reader, msg);
+  packet.erase(packet.begin(), packet.begin() + reader.Position());
+  return msg;
+}
+
+UdpPing UdpPing::Deserialize(ByteReader& reader) {
+  UdpPing msg;
+  Deserialize(reader, msg);
+  return msg;
+}
+
+UdpPing UdpPing::Deserialize(ByteReader& reader, UdpPing& msg) {
+  String::Deserialize(reader, msg.id_);
+  String::Deserialize(reader, msg.name_);
+  String::Deserialize(reader, msg.udp_address_);
+  UInt16::Deserialize(reader, msg.udp_port_);
+  String::Deserialize(reader, msg.tcp_address_);
+  UInt16::Deserialize(reader, msg.tcp_port_);
   return msg;
 }
 
@@ -56,24 +84,39 @@ UdpPong::UdpPong(const std::string& id, const std::string& name,
       tcp_address_(tcp_address),
       tcp_port_(tcp_port) {}
 
+std::size_t UdpPong::EncodedSize(const UdpPong& msg) {
+  return String::EncodedSize(msg.id_) +
+         String::EncodedSize(msg.name_) +
+         String::EncodedSize(msg.udp_address_) +
+         UInt16::EncodedSize(msg.udp_port_) +
+         String::EncodedSize(msg.tcp_address_) +
+         UInt16::EncodedSize(msg.tcp_port_);
+}
+
 std::vector<char> UdpPong::Serialize(const UdpPong& msg) {
   std::vector<char> packet;
   Serialize(msg, packet);
   return packet;
 }
 
-std::vector<char> UdpPong::Serialize(const UdpPong& msg,
-                                     std::vector<char>& packet) {
-  String::Serialize("udp_pong", packet);
-  String::Serialize(msg.id_, packet);
-  String::Serialize(msg.name_, packet);
-  String::Serialize(msg.udp_address_, packet);
-  UInt16::Serialize(msg.udp_port_, packet);
-  String::Serialize(msg.tcp_address_, packet);
-  UInt16::Serialize(msg.tcp_port_, packet);
+std::vector<char>& UdpPong::Serialize(const UdpPong& msg,
+                                      std::vector<char>& packet) {
+  std::size_t offset = packet.size();
+  packet.resize(offset + EncodedSize(msg));
+  ByteWriter writer(packet.data() + offset, packet.size() - offset);
+  Serialize(msg, writer);
   return packet;
 }
 
+void UdpPong::Serialize(const UdpPong& msg, ByteWriter& writer) {
+  String::Serialize(msg.id_, writer);
+  String::Serialize(msg.name_, writer);
+  String::Serialize(msg.udp_address_, writer);
+  UInt16::Serialize(msg.udp_port_, writer);
+  String::Serialize(msg.tcp_address_, writer);
+  UInt16::Serialize(msg.tcp_port_, writer);
+}
+
 UdpPong UdpPong::Deserialize(std::vector<char>& packet) {
   UdpPong msg;
   Deserialize(packet, msg);
@@ -81,12 +124,25 @@ UdpPong UdpPong::Deserialize(std::vector<char>& packet) {
 }
 
 UdpPong UdpPong::Deserialize(std::vector<char>& packet, UdpPong& msg) {
-  String::Deserialize(packet, msg.id_);
-  String::Deserialize(packet, msg.name_);
-  String::Deserialize(packet, msg.udp_address_);
-  UInt16::Deserialize(packet, msg.udp_port_);
-  String::Deserialize(packet, msg.tcp_address_);
-  UInt16::Deserialize(packet, msg.tcp_port_);
+  ByteReader reader(packet);
+  Deserialize(reader, msg);
+  packet.erase(packet.begin(), packet.begin() + reader.Position());
+  return msg;
+}
+
+UdpPong UdpPong::Deserialize(ByteReader& reader) {
+  UdpPong msg;
+  Deserialize(reader, msg);
+  return msg;
+}
+
+UdpPong UdpPong::Deserialize(ByteReader& reader, UdpPong& msg) {
+  String::Deserialize(reader, msg.id_);
+  String::Deserialize(reader, msg.name_);
+  String::Deserialize(reader, msg.udp_address_);
+  UInt16::Deserialize(reader, msg.udp_port_);
+  String::Deserialize(reader, msg.tcp_address_);
+  UInt16::Deserialize(reader, msg.tcp_port_);
   return msg;
 }
 
@@ -98,7 +154,27 @@ TcpPing::TcpPing(const std::string& id, const std::string& name,
       udp_address_(udp_address),
       udp_port_(udp_port),
       tcp_address_(tcp_address),
-      tcp_port_(tcp_port) {}
+      tcp_port_(tcp_port),
+      data_port_(0) {}
+
+std::size_t TcpPing::EncodedSize(const TcpPing& msg) {
+  std::size_t size = String::EncodedSize(msg.id_) +
+                     String::EncodedSize(msg.name_) +
+                     String::EncodedSize(msg.udp_address_) +
+                     UInt16::EncodedSize(msg.udp_port_) +
+                     String::EncodedSize(msg.tcp_address_) +
+                     UInt16::EncodedSize(msg.tcp_port_) +
+                     UInt16::EncodedSize(msg.data_port_) +
+                     UInt32::EncodedSize(msg.subscribed_topics_.size()) +
+                     UInt32::EncodedSize(msg.multicast_topics_.size());
+  for (const auto& topic : msg.subscribed_topics_) {
+    size += String::EncodedSize(topic);
+  }
+  for (const auto& topic : msg.multicast_topics_) {
+    size += String::EncodedSize(topic);
+  }
+  return size;
+}
 
 std::vector<char> TcpPing::Serialize(const TcpPing& msg) {
   std::vector<char> packet;
@@ -106,20 +182,31 @@ std::vector<char> TcpPing::Serialize(const TcpPing& msg) {
   return packet;
 }
 
-std::vector<char> TcpPing::Serialize(const TcpPing& msg,
-                                     std::vector<char>& packet) {
-  String::Serialize("tcp_ping", packet);
-  String::Serialize(msg.id_, packet);
-  String::Serialize(msg.name_, packet);
-  String::Serialize(msg.udp_address_, packet);
-  UInt16::Serialize(msg.udp_port_, packet);
-  String::Serialize(msg.tcp_address_, packet);
-  UInt16::Serialize(msg.tcp_port_, packet);
-  UInt32::Serialize(msg.subscribed_topics_.size(), packet);
+std::vector<char>& TcpPing::Serialize(const TcpPing& msg,
+                                      std::vector<char>& packet) {
+  std::size_t offset = packet.size();
+  packet.resize(offset + EncodedSize(msg));
+  ByteWriter writer(packet.data() + offset, packet.size() - offset);
+  Serialize(msg, writer);
+  return packet;
+}
+
+void TcpPing::Serialize(const TcpPing& msg, ByteWriter& writer) {
+  String::Serialize(msg.id_, writer);
+  String::Serialize(msg.name_, writer);
+  String::Serialize(msg.udp_address_, writer);
+  UInt16::Serialize(msg.udp_port_, writer);
+  String::Serialize(msg.tcp_address_, writer);
+  UInt16::Serialize(msg.tcp_port_, writer);
+  UInt16::Serialize(msg.data_port_, writer);
+  UInt32::Serialize(msg.subscribed_topics_.size(), writer);
   for (const auto& topic : msg.subscribed_topics_) {
-    String::Serialize(topic, packet);
+    String::Serialize(topic, writer);
+  }
+  UInt32::Serialize(msg.multicast_topics_.size(), writer);
+  for (const auto& topic : msg.multicast_topics_) {
+    String::Serialize(topic, writer);
   }
-  return packet;
 }
 
 TcpPing TcpPing::Deserialize(std::vector<char>& packet) {
@@ -129,19 +216,36 @@ TcpPing TcpPing::Deserialize(std::vector<char>& packet) {
 }
 
 TcpPing TcpPing::Deserialize(std::vector<char>& packet, TcpPing& msg) {
-  String::Deserialize(packet, msg.id_);
-  String::Deserialize(packet, msg.name_);
-  String::Deserialize(packet, msg.udp_address_);
-  UInt16::Deserialize(packet, msg.udp_port_);
-  String::Deserialize(packet, msg.tcp_address_);
-  UInt16::Deserialize(packet, msg.tcp_port_);
+  ByteReader reader(packet);
+  Deserialize(reader, msg);
+  packet.erase(packet.begin(), packet.begin() + reader.Position());
+  return msg;
+}
+
+TcpPing TcpPing::Deserialize(ByteReader& reader) {
+  TcpPing msg;
+  Deserialize(reader, msg);
+  return msg;
+}
+
+TcpPing TcpPing::Deserialize(ByteReader& reader, TcpPing& msg) {
+  String::Deserialize(reader, msg.id_);
+  String::Deserialize(reader, msg.name_);
+  String::Deserialize(reader, msg.udp_address_);
+  UInt16::Deserialize(reader, msg.udp_port_);
+  String::Deserialize(reader, msg.tcp_address_);
+  UInt16::Deserialize(reader, msg.tcp_port_);
+  UInt16::Deserialize(reader, msg.data_port_);
   uint32_t topic_count;
-  UInt32::Deserialize(packet, topic_count);
+  UInt32::Deserialize(reader, topic_count);
   msg.subscribed_topics_.clear();
   for (uint32_t i = 0; i < topic_count; ++i) {
-    std::string topic;
-    String::Deserialize(packet, topic);
-    msg.subscribed_topics_.push_back(topic);
+    msg.subscribed_topics_.push_back(String::Deserialize(reader));
+  }
+  UInt32::Deserialize(reader, topic_count);
+  msg.multicast_topics_.clear();
+  for (uint32_t i = 0; i < topic_count; ++i) {
+    msg.multicast_topics_.push_back(String::Deserialize(reader));
   }
   return msg;
 }
@@ -154,7 +258,27 @@ TcpPong::TcpPong(const std::string& id, const std::string& name,
       udp_address_(udp_address),
       udp_port_(udp_port),
       tcp_address_(tcp_address),
-      tcp_port_(tcp_port) {}
+      tcp_port_(tcp_port),
+      data_port_(0) {}
+
+std::size_t TcpPong::EncodedSize(const TcpPong& msg) {
+  std::size_t size = String::EncodedSize(msg.id_) +
+                     String::EncodedSize(msg.name_) +
+                     String::EncodedSize(msg.udp_address_) +
+                     UInt16::EncodedSize(msg.udp_port_) +
+                     String::EncodedSize(msg.tcp_address_) +
+                     UInt16::EncodedSize(msg.tcp_port_) +
+                     UInt16::EncodedSize(msg.data_port_) +
+                     UInt32::EncodedSize(msg.subscribed_topics_.size()) +
+                     UInt32::EncodedSize(msg.multicast_topics_.size());
+  for (const auto& topic : msg.subscribed_topics_) {
+    size += String::EncodedSize(topic);
+  }
+  for (const auto& topic : msg.multicast_topics_) {
+    size += String::EncodedSize(topic);
+  }
+  return size;
+}
 
 std::vector<char> TcpPong::Serialize(const TcpPong& msg) {
   std::vector<char> packet;
@@ -162,20 +286,31 @@ std::vector<char> TcpPong::Serialize(const TcpPong& msg) {
   return packet;
 }
 
-std::vector<char> TcpPong::Serialize(const TcpPong& msg,
-                                     std::vector<char>& packet) {
-  String::Serialize("tcp_pong", packet);
-  String::Serialize(msg.id_, packet);
-  String::Serialize(msg.name_, packet);
-  String::Serialize(msg.udp_address_, packet);
-  UInt16::Serialize(msg.udp_port_, packet);
-  String::Serialize(msg.tcp_address_, packet);
-  UInt16::Serialize(msg.tcp_port_, packet);
-  UInt32::Serialize(msg.subscribed_topics_.size(), packet);
+std::vector<char>& TcpPong::Serialize(const TcpPong& msg,
+                                      std::vector<char>& packet) {
+  std::size_t offset = packet.size();
+  packet.resize(offset + EncodedSize(msg));
+  ByteWriter writer(packet.data() + offset, packet.size() - offset);
+  Serialize(msg, writer);
+  return packet;
+}
+
+void TcpPong::Serialize(const TcpPong& msg, ByteWriter& writer) {
+  String::Serialize(msg.id_, writer);
+  String::Serialize(msg.name_, writer);
+  String::Serialize(msg.udp_address_, writer);
+  UInt16::Serialize(msg.udp_port_, writer);
+  String::Serialize(msg.tcp_address_, writer);
+  UInt16::Serialize(msg.tcp_port_, writer);
+  UInt16::Serialize(msg.data_port_, writer);
+  UInt32::Serialize(msg.subscribed_topics_.size(), writer);
   for (const auto& topic : msg.subscribed_topics_) {
-    String::Serialize(topic, packet);
+    String::Serialize(topic, writer);
+  }
+  UInt32::Serialize(msg.multicast_topics_.size(), writer);
+  for (const auto& topic : msg.multicast_topics_) {
+    String::Serialize(topic, writer);
   }
-  return packet;
 }
 
 TcpPong TcpPong::Deserialize(std::vector<char>& packet) {
@@ -185,19 +320,36 @@ TcpPong TcpPong::Deserialize(std::vector<char>& packet) {
 }
 
 TcpPong TcpPong::Deserialize(std::vector<char>& packet, TcpPong& msg) {
-  String::Deserialize(packet, msg.id_);
-  String::Deserialize(packet, msg.name_);
-  String::Deserialize(packet, msg.udp_address_);
-  UInt16::Deserialize(packet, msg.udp_port_);
-  String::Deserialize(packet, msg.tcp_address_);
-  UInt16::Deserialize(packet, msg.tcp_port_);
+  ByteReader reader(packet);
+  Deserialize(reader, msg);
+  packet.erase(packet.begin(), packet.begin() + reader.Position());
+  return msg;
+}
+
+TcpPong TcpPong::Deserialize(ByteReader& reader) {
+  TcpPong msg;
+  Deserialize(reader, msg);
+  return msg;
+}
+
+TcpPong TcpPong::Deserialize(ByteReader& reader, TcpPong& msg) {
+  String::Deserialize(reader, msg.id_);
+  String::Deserialize(reader, msg.name_);
+  String::Deserialize(reader, msg.udp_address_);
+  UInt16::Deserialize(reader, msg.udp_port_);
+  String::Deserialize(reader, msg.tcp_address_);
+  UInt16::Deserialize(reader, msg.tcp_port_);
+  UInt16::Deserialize(reader, msg.data_port_);
   uint32_t topic_count;
-  UInt32::Deserialize(packet, topic_count);
+  UInt32::Deserialize(reader, topic_count);
   msg.subscribed_topics_.clear();
   for (uint32_t i = 0; i < topic_count; ++i) {
-    std::string topic;
-    String::Deserialize(packet, topic);
-    msg.subscribed_topics_.push_back(topic);
+    msg.subscribed_topics_.push_back(String::Deserialize(reader));
+  }
+  UInt32::Deserialize(reader, topic_count);
+  msg.multicast_topics_.clear();
+  for (uint32_t i = 0; i < topic_count; ++i) {
+    msg.multicast_topics_.push_back(String::Deserialize(reader));
   }
   return msg;
 }
@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <farfler/network/protocol.hpp>
+#include <farfler/network/types.hpp>
+
+namespace farfler::network {
+
+FrameHeader::FrameHeader(MessageKind kind)
+    : magic_(kProtocolMagic), version_(kProtocolVersion), kind_(kind) {}
+
+std::size_t FrameHeader::EncodedSize(const FrameHeader& msg) {
+  return UInt8::EncodedSize(msg.magic_) + UInt8::EncodedSize(msg.version_) +
+         UInt8::EncodedSize(static_cast<uint8_t>(msg.kind_));
+}
+
+void FrameHeader::Serialize(const FrameHeader& msg, ByteWriter& writer) {
+  UInt8::Serialize(msg.magic_, writer);
+  UInt8::Serialize(msg.version_, writer);
+  UInt8::Serialize(static_cast<uint8_t>(msg.kind_), writer);
+}
+
+FrameHeader FrameHeader::Deserialize(ByteReader& reader) {
+  FrameHeader msg;
+  Deserialize(reader, msg);
+  return msg;
+}
+
+FrameHeader FrameHeader::Deserialize(ByteReader& reader, FrameHeader& msg) {
+  UInt8::Deserialize(reader, msg.magic_);
+  UInt8::Deserialize(reader, msg.version_);
+  msg.kind_ = static_cast<MessageKind>(UInt8::Deserialize(reader));
+  return msg;
+}
+
+std::size_t FrameHeader::EncodedDatagramSize(const FrameHeader& msg) {
+  return UInt32::EncodedSize(kDatagramTag.size()) + kDatagramTag.size() +
+         EncodedSize(msg);
+}
+
+void FrameHeader::SerializeDatagram(const FrameHeader& msg,
+                                    ByteWriter& writer) {
+  UInt32::Serialize(kDatagramTag.size(), writer);
+  writer.Write(kDatagramTag.data(), kDatagramTag.size());
+  Serialize(msg, writer);
+}
+
+FrameHeader FrameHeader::DeserializeDatagram(ByteReader& reader) {
+  FrameHeader msg;
+  if (UInt32::Deserialize(reader) != kDatagramTag.size() ||
+      !std::equal(kDatagramTag.begin(), kDatagramTag.end(),
+                  reader.Read(kDatagramTag.size()))) {
+    msg.magic_ = 0;
+    return msg;
+  }
+  return Deserialize(reader, msg);
+}
+
+bool FrameHeader::IsLegacy(ByteReader reader) {
+  if (reader.Remaining() < UInt32::EncodedSize(0)) {
+    return false;
+  }
+
+  uint32_t size = UInt32::Deserialize(reader);
+  if (size == 0 || size > 16 || size > reader.Remaining()) {
+    return false;
+  }
+
+  const char* tag = reader.Read(size);
+  if (size == kDatagramTag.size() &&
+      std::equal(kDatagramTag.begin(), kDatagramTag.end(), tag)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < size; ++i) {
+    if ((tag[i] < 'a' || tag[i] > 'z') && tag[i] != '_') {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace farfler::network
@@ -1,59 +1,109 @@
 #include <farfler/network/pubsub.hpp>
+#include <iostream>
 
 namespace farfler::network {
 
-Subscription::Subscription(const std::string& id) : id_(id) {}
+Subscription::Subscription(uint64_t id) : id_(id) {}
 
-void PubSub::UnsubscribeOffline(const std::string& topic,
-                                const Subscription& subscription) {
+void PubSub::UnsubscribeOffline(const Subscription& subscription) {
   std::lock_guard<std::mutex> lock(mutex_);
-  offline_subscribers_[topic].erase(subscription.id_);
+  ReleaseSubscription(subscription, true, false);
 }
 
-void PubSub::UnsubscribeOnline(const std::string& topic,
-                               const Subscription& subscription) {
+void PubSub::UnsubscribeOnline(const Subscription& subscription) {
   std::lock_guard<std::mutex> lock(mutex_);
-  online_subscribers_[topic].erase(subscription.id_);
+  ReleaseSubscription(subscription, false, true);
 }
 
-void PubSub::PublishOffline(const std::string& topic,
-                            const std::vector<char>& message) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  for (const auto& [id, subscriber] : offline_subscribers_[topic]) {
-    subscriber(message);
+void PubSub::PublishOffline(const std::string& topic, std::type_index type,
+                            const void* message) {
+  auto subscribers = offline_subscribers_.Find(topic);
+  if (!subscribers) {
+    return;
+  }
+
+  for (const auto& [id, subscriber] : *subscribers) {
+    if (subscriber.type != type) {
+      std::cerr << "Type mismatch on topic " << topic << ": published "
+                << type.name() << ", subscribed " << subscriber.type.name()
+                << std::endl;
+      continue;
+    }
+    subscriber.callback(message);
   }
 }
 
 void PubSub::PublishOnline(const std::string& topic,
-                           const std::vector<char>& message) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  for (const auto& [id, subscriber] : online_subscribers_[topic]) {
-    subscriber(message);
+                           const std::vector<char>& message,
+                           const MessageInfo& info) {
+  PublishOnline(topic, ByteReader(message), info);
+}
+
+void PubSub::PublishOnline(const std::string& topic, const ByteReader& message,
+                           const MessageInfo& info) {
+  auto subscribers = online_subscribers_.Find(topic);
+  if (!subscribers) {
+    return;
+  }
+
+  for (const auto& [id, subscriber] : *subscribers) {
+    subscriber(message, info);
   }
 }
 
-void PubSub::Unsubscribe(const std::string& topic,
-                            const Subscription& subscription) {
+void PubSub::Unsubscribe(const Subscription& subscription) {
   std::lock_guard<std::mutex> lock(mutex_);
-  offline_subscribers_[topic].erase(subscription.id_);
-  online_subscribers_[topic].erase(subscription.id_);
+  ReleaseSubscription(subscription, true, true);
 }
 
 std::vector<std::string> PubSub::GetOnlineSubscribedTopics() const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  std::vector<std::string> topics;
-  for (const auto& [topic, subscribers] : online_subscribers_) {
-    if (!subscribers.empty()) {
-      topics.push_back(topic);
-    }
+  return online_subscribers_.Topics();
+}
+
+// Callers must hold mutex_.
+uint64_t PubSub::AcquireSubscription() {
+  uint32_t index;
+  if (!free_subscription_slots_.empty()) {
+    index = free_subscription_slots_.back();
+    free_subscription_slots_.pop_back();
+  } else {
+    index = subscription_slots_.size();
+    subscription_slots_.push_back(SubscriptionSlot{1, nullptr, nullptr});
   }
-  return topics;
+
+  return static_cast<uint64_t>(subscription_slots_[index].generation) << 32 |
+         index;
+}
+
+// Callers must hold mutex_ and pass an id they have just acquired.
+PubSub::SubscriptionSlot& PubSub::GetSubscription(uint64_t id) {
+  return subscription_slots_[static_cast<uint32_t>(id)];
 }
 
-std::string PubSub::GenerateSubscriptionId() {
-  boost::uuids::random_generator generator;
-  boost::uuids::uuid uuid = generator();
-  return boost::uuids::to_string(uuid);
+// Callers must hold mutex_. Stale or unknown handles are ignored. The slot is
+// recycled under a new generation once neither side uses it.
+void PubSub::ReleaseSubscription(const Subscription& subscription,
+                                 bool offline, bool online) {
+  uint32_t index = static_cast<uint32_t>(subscription.id_);
+  uint32_t generation = static_cast<uint32_t>(subscription.id_ >> 32);
+  if (index >= subscription_slots_.size() ||
+      subscription_slots_[index].generation != generation) {
+    return;
+  }
+
+  SubscriptionSlot& slot = subscription_slots_[index];
+  if (offline && slot.offline) {
+    offline_subscribers_.Remove(slot.offline, subscription.id_);
+    slot.offline.reset();
+  }
+  if (online && slot.online) {
+    online_subscribers_.Remove(slot.online, subscription.id_);
+    slot.online.reset();
+  }
+  if (!slot.offline && !slot.online) {
+    slot.generation = slot.generation == UINT32_MAX ? 1 : slot.generation + 1;
+    free_subscription_slots_.push_back(index);
+  }
 }
 
 }  // namespace farfler::network
\ No newline at end of file
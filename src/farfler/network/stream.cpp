@@ -0,0 +1,68 @@
+#include <cstring>
+#include <farfler/network/stream.hpp>
+#include <stdexcept>
+#include <string>
+
+namespace farfler::network {
+
+ByteReader::ByteReader(const char* data, std::size_t size)
+    : data_(data), size_(size), position_(0) {}
+
+ByteReader::ByteReader(const std::vector<char>& packet)
+    : ByteReader(packet.data(), packet.size()) {}
+
+const char* ByteReader::Read(std::size_t size) {
+  if (size > Remaining()) {
+    throw std::out_of_range("ByteReader: read of " + std::to_string(size) +
+                            " bytes with " + std::to_string(Remaining()) +
+                            " remaining");
+  }
+  const char* begin = data_ + position_;
+  position_ += size;
+  return begin;
+}
+
+void ByteReader::Read(void* destination, std::size_t size) {
+  memcpy(destination, Read(size), size);
+}
+
+void ByteReader::Skip(std::size_t size) { Read(size); }
+
+const char* ByteReader::Data() const { return data_ + position_; }
+
+std::size_t ByteReader::Position() const { return position_; }
+
+std::size_t ByteReader::Remaining() const { return size_ - position_; }
+
+bool ByteReader::Empty() const { return position_ == size_; }
+
+ByteWriter::ByteWriter(char* data, std::size_t size)
+    : data_(data), size_(size), position_(0) {}
+
+ByteWriter::ByteWriter(std::vector<char>& packet)
+    : ByteWriter(packet.data(), packet.size()) {}
+
+char* ByteWriter::Write(std::size_t size) {
+  if (size > Remaining()) {
+    throw std::out_of_range("ByteWriter: write of " + std::to_string(size) +
+                            " bytes with " + std::to_string(Remaining()) +
+                            " remaining");
+  }
+  char* begin = data_ + position_;
+  position_ += size;
+  return begin;
+}
+
+void ByteWriter::Write(const void* source, std::size_t size) {
+  memcpy(Write(size), source, size);
+}
+
+char* ByteWriter::Data() const { return data_ + position_; }
+
+std::size_t ByteWriter::Position() const { return position_; }
+
+std::size_t ByteWriter::Remaining() const { return size_ - position_; }
+
+bool ByteWriter::Full() const { return position_ == size_; }
+
+}  // namespace farfler::network
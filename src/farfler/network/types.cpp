@@ -1,11 +1,17 @@
 #include <cstring>
 #include <farfler/network/types.hpp>
+#include <stdexcept>
 
 namespace farfler::network {
 
 template <typename T>
 Number<T>::Number(T value) : value(value) {}
 
+template <typename T>
+std::size_t Number<T>::EncodedSize(const T&) {
+  return sizeof(T);
+}
+
 template <typename T>
 std::vector<char> Number<T>::Serialize(const T& msg) {
   std::vector<char> packet;
@@ -14,13 +20,18 @@ std::vector<char> Number<T>::Serialize(const T& msg) {
 }
 
 template <typename T>
-std::vector<char> Number<T>::Serialize(const T& msg,
-                                       std::vector<char>& packet) {
+std::vector<char>& Number<T>::Serialize(const T& msg,
+                                        std::vector<char>& packet) {
   packet.insert(packet.end(), reinterpret_cast<const char*>(&msg),
                 reinterpret_cast<const char*>(&msg) + sizeof(T));
   return packet;
 }
 
+template <typename T>
+void Number<T>::Serialize(const T& msg, ByteWriter& writer) {
+  writer.Write(&msg, sizeof(T));
+}
+
 template <typename T>
 T Number<T>::Deserialize(std::vector<char>& packet) {
   T msg;
@@ -30,8 +41,22 @@ T Number<T>::Deserialize(std::vector<char>& packet) {
 
 template <typename T>
 T Number<T>::Deserialize(std::vector<char>& packet, T& msg) {
-  memcpy(&msg, packet.data(), sizeof(T));
-  packet.erase(packet.begin(), packet.begin() + sizeof(T));
+  ByteReader reader(packet);
+  Deserialize(reader, msg);
+  packet.erase(packet.begin(), packet.begin() + reader.Position());
+  return msg;
+}
+
+template <typename T>
+T Number<T>::Deserialize(ByteReader& reader) {
+  T msg;
+  Deserialize(reader, msg);
+  return msg;
+}
+
+template <typename T>
+T Number<T>::Deserialize(ByteReader& reader, T& msg) {
+  reader.Read(&msg, sizeof(T));
   return msg;
 }
 
@@ -54,19 +79,30 @@ template class Number<bool>;
 
 String::String(const std::string& value) : value(value) {}
 
+std::size_t String::EncodedSize(const std::string& msg) {
+  return UInt32::EncodedSize(msg.size()) + msg.size();
+}
+
 std::vector<char> String::Serialize(const std::string& msg) {
   std::vector<char> packet;
   Serialize(msg, packet);
   return packet;
 }
 
-std::vector<char> String::Serialize(const std::string& msg,
-                                    std::vector<char>& packet) {
-  UInt32::Serialize(msg.size(), packet);
-  packet.insert(packet.end(), msg.begin(), msg.end());
+std::vector<char>& String::Serialize(const std::string& msg,
+                                     std::vector<char>& packet) {
+  std::size_t offset = packet.size();
+  packet.resize(offset + EncodedSize(msg));
+  ByteWriter writer(packet.data() + offset, packet.size() - offset);
+  Serialize(msg, writer);
   return packet;
 }
 
+void String::Serialize(const std::string& msg, ByteWriter& writer) {
+  UInt32::Serialize(msg.size(), writer);
+  writer.Write(msg.data(), msg.size());
+}
+
 std::string String::Deserialize(std::vector<char>& packet) {
   std::string msg;
   Deserialize(packet, msg);
@@ -74,9 +110,21 @@ std::string String::Deserialize(std::vector<char>& packet) {
 }
 
 std::string String::Deserialize(std::vector<char>& packet, std::string& msg) {
-  uint32_t size = UInt32::Deserialize(packet);
-  msg = std::string(packet.begin(), packet.begin() + size);
-  packet.erase(packet.begin(), packet.begin() + size);
+  ByteReader reader(packet);
+  Deserialize(reader, msg);
+  packet.erase(packet.begin(), packet.begin() + reader.Position());
+  return msg;
+}
+
+std::string String::Deserialize(ByteReader& reader) {
+  std::string msg;
+  Deserialize(reader, msg);
+  return msg;
+}
+
+std::string String::Deserialize(ByteReader& reader, std::string& msg) {
+  uint32_t size = UInt32::Deserialize(reader);
+  msg.assign(reader.Read(size), size);
   return msg;
 }
 
@@ -84,21 +132,101 @@ String::operator std::string() const {
     return value;
 }
 
+VarUInt32::VarUInt32(uint32_t value) : value(value) {}
+
+std::size_t VarUInt32::EncodedSize(const uint32_t& msg) {
+  std::size_t size = 1;
+  for (uint32_t rest = msg >> 7; rest != 0; rest >>= 7) {
+    ++size;
+  }
+  return size;
+}
+
+std::vector<char> VarUInt32::Serialize(const uint32_t& msg) {
+  std::vector<char> packet;
+  Serialize(msg, packet);
+  return packet;
+}
+
+std::vector<char>& VarUInt32::Serialize(const uint32_t& msg,
+                                        std::vector<char>& packet) {
+  std::size_t offset = packet.size();
+  packet.resize(offset + EncodedSize(msg));
+  ByteWriter writer(packet.data() + offset, packet.size() - offset);
+  Serialize(msg, writer);
+  return packet;
+}
+
+void VarUInt32::Serialize(const uint32_t& msg, ByteWriter& writer) {
+  uint32_t rest = msg;
+  while (rest >= 0x80) {
+    UInt8::Serialize(static_cast<uint8_t>(rest | 0x80), writer);
+    rest >>= 7;
+  }
+  UInt8::Serialize(static_cast<uint8_t>(rest), writer);
+}
+
+uint32_t VarUInt32::Deserialize(std::vector<char>& packet) {
+  uint32_t msg;
+  Deserialize(packet, msg);
+  return msg;
+}
+
+uint32_t VarUInt32::Deserialize(std::vector<char>& packet, uint32_t& msg) {
+  ByteReader reader(packet);
+  Deserialize(reader, msg);
+  packet.erase(packet.begin(), packet.begin() + reader.Position());
+  return msg;
+}
+
+uint32_t VarUInt32::Deserialize(ByteReader& reader) {
+  uint32_t msg;
+  Deserialize(reader, msg);
+  return msg;
+}
+
+uint32_t VarUInt32::Deserialize(ByteReader& reader, uint32_t& msg) {
+  msg = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    uint8_t byte = UInt8::Deserialize(reader);
+    msg |= static_cast<uint32_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return msg;
+    }
+  }
+  throw std::out_of_range("VarUInt32: encoding longer than five bytes");
+}
+
+VarUInt32::operator uint32_t() const {
+    return value;
+}
+
 Vector2::Vector2(float x, float y) : x(x), y(y) {}
 
+std::size_t Vector2::EncodedSize(const Vector2& msg) {
+  return Float32::EncodedSize(msg.x) + Float32::EncodedSize(msg.y);
+}
+
 std::vector<char> Vector2::Serialize(const Vector2& msg) {
   std::vector<char> packet;
   Serialize(msg, packet);
   return packet;
 }
 
-std::vector<char> Vector2::Serialize(const Vector2& msg,
-                                     std::vector<char>& packet) {
-  Float32::Serialize(msg.x, packet);
-  Float32::Serialize(msg.y, packet);
+std::vector<char>& Vector2::Serialize(const Vector2& msg,
+                                      std::vector<char>& packet) {
+  std::size_t offset = packet.size();
+  packet.resize(offset + EncodedSize(msg));
+  ByteWriter writer(packet.data() + offset, packet.size() - offset);
+  Serialize(msg, writer);
   return packet;
 }
 
+void Vector2::Serialize(const Vector2& msg, ByteWriter& writer) {
+  Float32::Serialize(msg.x, writer);
+  Float32::Serialize(msg.y, writer);
+}
+
 Vector2 Vector2::Deserialize(std::vector<char>& packet) {
   Vector2 msg;
   Deserialize(packet, msg);
@@ -106,27 +234,53 @@ Vector2 Vector2::Deserialize(std::vector<char>& packet) {
 }
 
 Vector2 Vector2::Deserialize(std::vector<char>& packet, Vector2& msg) {
-  Float32::Deserialize(packet, msg.x);
-  Float32::Deserialize(packet, msg.y);
+  ByteReader reader(packet);
+  Deserialize(reader, msg);
+  packet.erase(packet.begin(), packet.begin() + reader.Position());
+  return msg;
+}
+
+Vector2 Vector2::Deserialize(ByteReader& reader) {
+  Vector2 msg;
+  Deserialize(reader, msg);
+  return msg;
+}
+
+Vector2 Vector2::Deserialize(ByteReader& reader, Vector2& msg) {
+  Float32::Deserialize(reader, msg.x);
+  Float32::Deserialize(reader, msg.y);
   return msg;
 }
 
 Vector3::Vector3(float x, float y, float z) : x(x), y(y), z(z) {}
 
+std::size_t Vector3::EncodedSize(const Vector3& msg) {
+  return Float32::EncodedSize(msg.x) +
+         Float32::EncodedSize(msg.y) +
+         Float32::EncodedSize(msg.z);
+}
+
 std::vector<char> Vector3::Serialize(const Vector3& msg) {
   std::vector<char> packet;
   Serialize(msg, packet);
   return packet;
 }
 
-std::vector<char> Vector3::Serialize(const Vector3& msg,
-                                     std::vector<char>& packet) {
-  Float32::Serialize(msg.x, packet);
-  Float32::Serialize(msg.y, packet);
-  Float32::Serialize(msg.z, packet);
+std::vector<char>& Vector3::Serialize(const Vector3& msg,
+                                      std::vector<char>& packet) {
+  std::size_t offset = packet.size();
+  packet.resize(offset + EncodedSize(msg));
+  ByteWriter writer(packet.data() + offset, packet.size() - offset);
+  Serialize(msg, writer);
   return packet;
 }
 
+void Vector3::Serialize(const Vector3& msg, ByteWriter& writer) {
+  Float32::Serialize(msg.x, writer);
+  Float32::Serialize(msg.y, writer);
+  Float32::Serialize(msg.z, writer);
+}
+
 Vector3 Vector3::Deserialize(std::vector<char>& packet) {
   Vector3 msg;
   Deserialize(packet, msg);
@@ -134,28 +288,53 @@ Vector3 Vector3::Deserialize(std::vector<char>& packet) {
 }
 
 Vector3 Vector3::Deserialize(std::vector<char>& packet, Vector3& msg) {
-  Float32::Deserialize(packet, msg.x);
-  Float32::Deserialize(packet, msg.y);
-  Float32::Deserialize(packet, msg.z);
+  ByteReader reader(packet);
+  Deserialize(reader, msg);
+  packet.erase(packet.begin(), packet.begin() + reader.Position());
+  return msg;
+}
+
+Vector3 Vector3::Deserialize(ByteReader& reader) {
+  Vector3 msg;
+  Deserialize(reader, msg);
+  return msg;
+}
+
+Vector3 Vector3::Deserialize(ByteReader& reader, Vector3& msg) {
+  Float32::Deserialize(reader, msg.x);
+  Float32::Deserialize(reader, msg.y);
+  Float32::Deserialize(reader, msg.z);
   return msg;
 }
 
 Coordinate::Coordinate(double latitude, double longitude)
     : latitude(latitude), longitude(longitude) {}
 
+std::size_t Coordinate::EncodedSize(const Coordinate& msg) {
+  return Float64::EncodedSize(msg.latitude) +
+         Float64::EncodedSize(msg.longitude);
+}
+
 std::vector<char> Coordinate::Serialize(const Coordinate& msg) {
   std::vector<char> packet;
   Serialize(msg, packet);
   return packet;
 }
 
-std::vector<char> Coordinate::Serialize(const Coordinate& msg,
-                                        std::vector<char>& packet) {
-  Float64::Serialize(msg.latitude, packet);
-  Float64::Serialize(msg.longitude, packet);
+std::vector<char>& Coordinate::Serialize(const Coordinate& msg,
+                                         std::vector<char>& packet) {
+  std::size_t offset = packet.size();
+  packet.resize(offset + EncodedSize(msg));
+  ByteWriter writer(packet.data() + offset, packet.size() - offset);
+  Serialize(msg, writer);
   return packet;
 }
 
+void Coordinate::Serialize(const Coordinate& msg, ByteWriter& writer) {
+  Float64::Serialize(msg.latitude, writer);
+  Float64::Serialize(msg.longitude, writer);
+}
+
 Coordinate Coordinate::Deserialize(std::vector<char>& packet) {
   Coordinate msg;
   Deserialize(packet, msg);
@@ -163,8 +342,21 @@ Coordinate Coordinate::Deserialize(std::vector<char>& packet) {
 }
 
 Coordinate Coordinate::Deserialize(std::vector<char>& packet, Coordinate& msg) {
-  Float64::Deserialize(packet, msg.latitude);
-  Float64::Deserialize(packet, msg.longitude);
+  ByteReader reader(packet);
+  Deserialize(reader, msg);
+  packet.erase(packet.begin(), packet.begin() + reader.Position());
+  return msg;
+}
+
+Coordinate Coordinate::Deserialize(ByteReader& reader) {
+  Coordinate msg;
+  Deserialize(reader, msg);
+  return msg;
+}
+
+Coordinate Coordinate::Deserialize(ByteReader& reader, Coordinate& msg) {
+  Float64::Deserialize(reader, msg.latitude);
+  Float64::Deserialize(reader, msg.longitude);
   return msg;
 }
 
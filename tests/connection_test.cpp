@@ -0,0 +1,332 @@
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <farfler/network/buffer_pool.hpp>
+#include <farfler/network/connection.hpp>
+#include <farfler/network/protocol.hpp>
+#include <farfler/network/stream.hpp>
+#include <farfler/network/topic_options.hpp>
+#include <farfler/network/types.hpp>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace farfler::network;
+using boost::asio::ip::tcp;
+
+namespace {
+
+int failures = 0;
+
+#define EXPECT(condition)                                               \
+  do {                                                                  \
+    if (!(condition)) {                                                 \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": expected "         \
+                << #condition << std::endl;                             \
+      ++failures;                                                       \
+    }                                                                   \
+  } while (false)
+
+struct ReceivedFrame {
+  MessageKind kind;
+  std::vector<char> body;
+};
+
+std::vector<char> Payload(std::size_t size, int seed) {
+  std::vector<char> payload(size);
+  for (std::size_t i = 0; i < size; ++i) {
+    payload[i] = static_cast<char>((seed + i) % 251);
+  }
+  return payload;
+}
+
+std::vector<char> PublicationBody(uint32_t topic_id,
+                                  const std::vector<char>& payload) {
+  std::vector<char> body(VarUInt32::EncodedSize(topic_id) + payload.size());
+  ByteWriter writer(body);
+  VarUInt32::Serialize(topic_id, writer);
+  writer.Write(payload.data(), payload.size());
+  return body;
+}
+
+// A frame without its length prefix, the way fragments carry it.
+std::vector<char> FrameBody(MessageKind kind, const std::vector<char>& body) {
+  FrameHeader header(kind);
+  std::vector<char> frame(FrameHeader::EncodedSize(header) + body.size());
+  ByteWriter writer(frame);
+  FrameHeader::Serialize(header, writer);
+  writer.Write(body.data(), body.size());
+  return frame;
+}
+
+Frame MakeFrame(BufferPool& pool, MessageKind kind,
+                const std::vector<char>& body) {
+  FrameHeader header(kind);
+  uint32_t packet_size = FrameHeader::EncodedSize(header) + body.size();
+  Frame frame = pool.Acquire(UInt32::EncodedSize(packet_size) + packet_size);
+  ByteWriter writer(*frame);
+  UInt32::Serialize(packet_size, writer);
+  FrameHeader::Serialize(header, writer);
+  writer.Write(body.data(), body.size());
+  return frame;
+}
+
+Frame MakeAnnouncement(BufferPool& pool, uint32_t topic_id) {
+  std::string topic = "topic" + std::to_string(topic_id);
+  std::vector<char> body(VarUInt32::EncodedSize(topic_id) +
+                         String::EncodedSize(topic));
+  ByteWriter writer(body);
+  VarUInt32::Serialize(topic_id, writer);
+  String::Serialize(topic, writer);
+  return MakeFrame(pool, MessageKind::kTopic, body);
+}
+
+// One chunk of a fragmented frame body, the way a peer puts it on the wire.
+std::vector<char> MakeFragment(uint32_t lane, const std::vector<char>& frame,
+                               std::size_t offset, std::size_t size) {
+  FrameHeader header(MessageKind::kFragment);
+  uint32_t packet_size = FrameHeader::EncodedSize(header) +
+                         VarUInt32::EncodedSize(lane) +
+                         UInt32::EncodedSize(0) + size;
+  std::vector<char> packet(UInt32::EncodedSize(packet_size) + packet_size);
+  ByteWriter writer(packet);
+  UInt32::Serialize(packet_size, writer);
+  FrameHeader::Serialize(header, writer);
+  VarUInt32::Serialize(lane, writer);
+  UInt32::Serialize(frame.size(), writer);
+  writer.Write(frame.data() + offset, size);
+  return packet;
+}
+
+// A connection receiving from a loopback socket that the test writes to
+// either directly or through a sending Connection. The receiver records
+// every frame handed to its frame handler.
+class Loopback {
+ public:
+  Loopback() : pool_(std::make_shared<BufferPool>()), client_(io_) {
+    tcp::acceptor acceptor(
+        io_, tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), 0));
+    client_.connect(acceptor.local_endpoint());
+    receiver_ = std::make_shared<Connection>(acceptor.accept(), io_, pool_);
+    receiver_->SetFrameHandler(
+        [this](std::shared_ptr<Connection>, ByteReader& reader) {
+          FrameHeader header = FrameHeader::Deserialize(reader);
+          std::size_t size = reader.Remaining();
+          const char* body = reader.Read(size);
+          frames_.push_back(ReceivedFrame{
+              header.kind_, std::vector<char>(body, body + size)});
+        });
+    receiver_->SetErrorHandler(
+        [this](std::shared_ptr<Connection>,
+               const boost::system::error_code& error) { error_ = error; });
+    receiver_->StartReceiving();
+  }
+
+  // Hands the client socket to a sending Connection.
+  std::shared_ptr<Connection> Sender() {
+    sender_ = std::make_shared<Connection>(std::move(client_), io_, pool_);
+    return sender_;
+  }
+
+  void WriteRaw(const std::vector<char>& bytes) {
+    boost::asio::write(client_, boost::asio::buffer(bytes));
+  }
+
+  // Runs until count frames have arrived or the receiver has failed, and a
+  // little longer to catch any frames that should not have arrived.
+  void RunUntil(std::size_t count) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (frames_.size() < count && !error_ &&
+           std::chrono::steady_clock::now() < deadline) {
+      io_.run_one_for(std::chrono::milliseconds(100));
+    }
+    io_.run_for(std::chrono::milliseconds(50));
+  }
+
+  BufferPool& Pool() { return *pool_; }
+  std::shared_ptr<Connection> Receiver() { return receiver_; }
+  const std::vector<ReceivedFrame>& Frames() const { return frames_; }
+  boost::system::error_code Error() const { return error_; }
+
+ private:
+  boost::asio::io_context io_;
+  std::shared_ptr<BufferPool> pool_;
+  tcp::socket client_;
+  std::shared_ptr<Connection> sender_;
+  std::shared_ptr<Connection> receiver_;
+  std::vector<ReceivedFrame> frames_;
+  boost::system::error_code error_;
+};
+
+// Batched publications go out as one batch frame that splits back into the
+// publications in order, behind the topic's announcement.
+void TestBatchRoundTrip() {
+  Loopback link;
+  std::shared_ptr<Connection> sender = link.Sender();
+  sender->SetBatchOptions(
+      BatchOptions{std::chrono::milliseconds(5), 64 * 1024});
+
+  std::vector<std::vector<char>> payloads;
+  for (int i = 0; i < 5; ++i) {
+    payloads.push_back(Payload(10 + i * 100, i));
+    sender->SendPublication(
+        7, MakeAnnouncement(link.Pool(), 7),
+        MakeFrame(link.Pool(), MessageKind::kPublication,
+                  PublicationBody(7, payloads.back())),
+        TopicOptions());
+  }
+  link.RunUntil(2);
+
+  EXPECT(!link.Error());
+  EXPECT(link.Frames().size() == 2);
+  if (link.Frames().size() != 2) {
+    return;
+  }
+  EXPECT(link.Frames()[0].kind == MessageKind::kTopic);
+  EXPECT(link.Frames()[1].kind == MessageKind::kBatch);
+
+  ByteReader batch(link.Frames()[1].body);
+  std::size_t count = 0;
+  while (!batch.Empty() && count < payloads.size()) {
+    uint32_t size = VarUInt32::Deserialize(batch);
+    ByteReader publication(batch.Read(size), size);
+    EXPECT(VarUInt32::Deserialize(publication) == 7);
+    EXPECT(publication.Remaining() == payloads[count].size());
+    EXPECT(std::equal(payloads[count].begin(), payloads[count].end(),
+                      publication.Read(publication.Remaining())));
+    ++count;
+  }
+  EXPECT(count == payloads.size());
+  EXPECT(batch.Empty());
+
+  Connection::QueueStats stats = sender->GetQueueStats();
+  EXPECT(stats.batches == 1);
+  EXPECT(stats.batched == payloads.size());
+  EXPECT(stats.messages == 0);
+}
+
+// A frame too large to send whole arrives intact after the higher lanes'
+// frames that were queued behind it.
+void TestFragmentRoundTrip() {
+  Loopback link;
+  std::shared_ptr<Connection> sender = link.Sender();
+  TopicOptions bulk;
+  bulk.priority = Priority::kBulk;
+  TopicOptions high;
+  high.priority = Priority::kHigh;
+
+  std::vector<char> large = Payload(Connection::kFragmentSize * 5 + 123, 1);
+  sender->SendPublication(
+      0, MakeAnnouncement(link.Pool(), 0),
+      MakeFrame(link.Pool(), MessageKind::kPublication,
+                PublicationBody(0, large)),
+      bulk);
+  std::vector<char> small = Payload(32, 2);
+  for (int i = 0; i < 3; ++i) {
+    sender->SendPublication(
+        1, MakeAnnouncement(link.Pool(), 1),
+        MakeFrame(link.Pool(), MessageKind::kPublication,
+                  PublicationBody(1, small)),
+        high);
+  }
+  link.RunUntil(6);
+
+  EXPECT(!link.Error());
+  EXPECT(link.Frames().size() == 6);
+  if (link.Frames().size() != 6) {
+    return;
+  }
+  EXPECT(link.Frames()[0].kind == MessageKind::kTopic);
+  EXPECT(link.Frames()[1].kind == MessageKind::kTopic);
+  for (int i = 2; i < 5; ++i) {
+    EXPECT(link.Frames()[i].body == PublicationBody(1, small));
+  }
+  EXPECT(link.Frames()[5].kind == MessageKind::kPublication);
+  EXPECT(link.Frames()[5].body == PublicationBody(0, large));
+}
+
+// Chunks of frames from different lanes reassemble independently, and
+// unfragmented frames between them are delivered straight away.
+void TestInterleavedReassembly() {
+  Loopback link;
+  std::vector<char> bulk_body = PublicationBody(0, Payload(30000, 3));
+  std::vector<char> bulk_frame =
+      FrameBody(MessageKind::kPublication, bulk_body);
+  std::vector<char> normal_body = PublicationBody(1, Payload(20000, 4));
+  std::vector<char> normal_frame =
+      FrameBody(MessageKind::kPublication, normal_body);
+  Frame plain = MakeFrame(link.Pool(), MessageKind::kPublication,
+                          PublicationBody(2, Payload(16, 5)));
+
+  link.WriteRaw(MakeFragment(2, bulk_frame, 0, 10000));
+  link.WriteRaw(MakeFragment(1, normal_frame, 0, 10000));
+  link.WriteRaw(*plain);
+  link.WriteRaw(MakeFragment(2, bulk_frame, 10000, 10000));
+  link.WriteRaw(
+      MakeFragment(1, normal_frame, 10000, normal_frame.size() - 10000));
+  link.WriteRaw(
+      MakeFragment(2, bulk_frame, 20000, bulk_frame.size() - 20000));
+  link.RunUntil(3);
+
+  EXPECT(!link.Error());
+  EXPECT(link.Frames().size() == 3);
+  if (link.Frames().size() != 3) {
+    return;
+  }
+  EXPECT(link.Frames()[0].body == PublicationBody(2, Payload(16, 5)));
+  EXPECT(link.Frames()[1].body == normal_body);
+  EXPECT(link.Frames()[2].body == bulk_body);
+}
+
+// A fragmented frame is measured against the limit by its whole size, so it
+// fails the connection from its first chunk.
+void TestReassemblyRejectsOversizedFrame() {
+  Loopback link;
+  link.Receiver()->SetMaxMessageSize(4096);
+  std::vector<char> frame(8192);
+  link.WriteRaw(MakeFragment(0, frame, 0, 1024));
+  link.RunUntil(1);
+
+  EXPECT(link.Error() == boost::asio::error::message_size);
+  EXPECT(link.Frames().empty());
+}
+
+// Publications on a conflated topic that are still waiting to be written are
+// replaced by newer ones, so only the newest goes out.
+void TestConflationKeepsNewest() {
+  Loopback link;
+  std::shared_ptr<Connection> sender = link.Sender();
+  TopicOptions options;
+  options.conflate = true;
+  for (int i = 0; i < 3; ++i) {
+    sender->SendPublication(
+        0, MakeAnnouncement(link.Pool(), 0),
+        MakeFrame(link.Pool(), MessageKind::kPublication,
+                  PublicationBody(0, Payload(8, i))),
+        options);
+  }
+  link.RunUntil(2);
+
+  EXPECT(!link.Error());
+  EXPECT(link.Frames().size() == 2);
+  if (link.Frames().size() != 2) {
+    return;
+  }
+  EXPECT(link.Frames()[0].kind == MessageKind::kTopic);
+  EXPECT(link.Frames()[1].body == PublicationBody(0, Payload(8, 2)));
+  EXPECT(sender->GetQueueStats().conflated == 2);
+}
+
+}  // namespace
+
+int main() {
+  TestBatchRoundTrip();
+  TestFragmentRoundTrip();
+  TestInterleavedReassembly();
+  TestReassemblyRejectsOversizedFrame();
+  TestConflationKeepsNewest();
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
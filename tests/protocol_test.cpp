@@ -0,0 +1,110 @@
+#include <cstdint>
+#include <cstdlib>
+#include <farfler/network/protocol.hpp>
+#include <farfler/network/stream.hpp>
+#include <farfler/network/types.hpp>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+using namespace farfler::network;
+
+namespace {
+
+int failures = 0;
+
+#define EXPECT(condition)                                               \
+  do {                                                                  \
+    if (!(condition)) {                                                 \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": expected "         \
+                << #condition << std::endl;                             \
+      ++failures;                                                       \
+    }                                                                   \
+  } while (false)
+
+void TestVarUInt32() {
+  const std::vector<std::pair<uint32_t, std::size_t>> cases = {
+      {0, 1},         {1, 1},         {127, 1},        {128, 2},
+      {16383, 2},     {16384, 3},     {2097151, 3},    {2097152, 4},
+      {268435455, 4}, {268435456, 5}, {UINT32_MAX, 5}};
+  for (const auto& [value, size] : cases) {
+    EXPECT(VarUInt32::EncodedSize(value) == size);
+    std::vector<char> packet(size);
+    ByteWriter writer(packet);
+    VarUInt32::Serialize(value, writer);
+    EXPECT(writer.Full());
+
+    ByteReader reader(packet);
+    EXPECT(VarUInt32::Deserialize(reader) == value);
+    EXPECT(reader.Empty());
+  }
+
+  // Truncated and overlong encodings are rejected.
+  std::vector<char> truncated = {static_cast<char>(0x80)};
+  ByteReader truncated_reader(truncated);
+  bool threw = false;
+  try {
+    VarUInt32::Deserialize(truncated_reader);
+  } catch (const std::out_of_range&) {
+    threw = true;
+  }
+  EXPECT(threw);
+
+  std::vector<char> overlong(6, static_cast<char>(0x80));
+  ByteReader overlong_reader(overlong);
+  threw = false;
+  try {
+    VarUInt32::Deserialize(overlong_reader);
+  } catch (const std::out_of_range&) {
+    threw = true;
+  }
+  EXPECT(threw);
+}
+
+void TestFrameHeader() {
+  FrameHeader header(MessageKind::kBatch);
+  EXPECT(FrameHeader::EncodedSize(header) == 3);
+  std::vector<char> packet(FrameHeader::EncodedSize(header));
+  ByteWriter writer(packet);
+  FrameHeader::Serialize(header, writer);
+  EXPECT(writer.Full());
+
+  ByteReader reader(packet);
+  FrameHeader decoded = FrameHeader::Deserialize(reader);
+  EXPECT(reader.Empty());
+  EXPECT(decoded.magic_ == kProtocolMagic);
+  EXPECT(decoded.version_ == kProtocolVersion);
+  EXPECT(decoded.kind_ == MessageKind::kBatch);
+  EXPECT(!FrameHeader::IsLegacy(ByteReader(packet)));
+}
+
+void TestDatagramHeader() {
+  FrameHeader header(MessageKind::kDatagramPublication);
+  std::vector<char> packet(FrameHeader::EncodedDatagramSize(header));
+  ByteWriter writer(packet);
+  FrameHeader::SerializeDatagram(header, writer);
+  EXPECT(writer.Full());
+  EXPECT(!FrameHeader::IsLegacy(ByteReader(packet)));
+
+  ByteReader reader(packet);
+  FrameHeader decoded = FrameHeader::DeserializeDatagram(reader);
+  EXPECT(reader.Empty());
+  EXPECT(decoded.magic_ == kProtocolMagic);
+  EXPECT(decoded.version_ == kProtocolVersion);
+  EXPECT(decoded.kind_ == MessageKind::kDatagramPublication);
+
+  // A legacy datagram starts with a different tag.
+  std::vector<char> legacy = String::Serialize("udp_ping");
+  EXPECT(FrameHeader::IsLegacy(ByteReader(legacy)));
+  ByteReader legacy_reader(legacy);
+  EXPECT(FrameHeader::DeserializeDatagram(legacy_reader).magic_ == 0);
+}
+
+}  // namespace
+
+int main() {
+  TestVarUInt32();
+  TestFrameHeader();
+  TestDatagramHeader();
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}